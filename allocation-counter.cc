@@ -0,0 +1,110 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "allocation-counter.h"
+
+#include <stdlib.h>
+#include <new>
+
+using namespace mustache;
+using namespace std;
+
+// Counters for the current thread. Thread-locals of the executable itself need no
+// allocation of their own, so they are safe to use from inside malloc().
+static thread_local AllocationCount thread_allocations;
+
+static void Count(size_t bytes) {
+  ++thread_allocations.allocations;
+  thread_allocations.bytes += bytes;
+}
+
+#ifdef __GLIBC__
+// glibc exports its allocator under these names too, so the replacements below can
+// forward to it.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+  Count(size);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+  Count(n * size);
+  return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  Count(size);
+  return __libc_realloc(ptr, size);
+}
+}
+
+static void* Allocate(size_t size) {
+  void* ptr = __libc_malloc(size);
+  if (ptr == nullptr) throw bad_alloc();
+  Count(size);
+  return ptr;
+}
+#else
+// Elsewhere only operator new is counted.
+static void* Allocate(size_t size) {
+  void* ptr = malloc(size);
+  if (ptr == nullptr) throw bad_alloc();
+  Count(size);
+  return ptr;
+}
+#endif
+
+void* operator new(size_t size) {
+  return Allocate(size);
+}
+
+void* operator new[](size_t size) {
+  return Allocate(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  free(ptr);
+}
+
+namespace mustache {
+
+AllocationCount ThreadAllocations() {
+  return thread_allocations;
+}
+
+AllocationCount CountAllocations(const function<void()>& fn, int iterations, int warmup) {
+  for (int i = 0; i < warmup; ++i) fn();
+  AllocationCount before = thread_allocations;
+  for (int i = 0; i < iterations; ++i) fn();
+  AllocationCount count;
+  count.allocations = thread_allocations.allocations - before.allocations;
+  count.bytes = thread_allocations.bytes - before.bytes;
+  return count;
+}
+
+}
@@ -0,0 +1,41 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Counts heap allocations, for tests and benchmarks that check that rendering doesn't
+// allocate. Linking allocation-counter.cc into a binary replaces malloc(), calloc(),
+// realloc() and operator new for the whole binary, so it is never part of the library.
+
+#ifndef MUSTACHE_ALLOCATION_COUNTER_H
+#define MUSTACHE_ALLOCATION_COUNTER_H
+
+#include <stdint.h>
+#include <functional>
+
+namespace mustache {
+
+struct AllocationCount {
+  int64_t allocations = 0;
+  int64_t bytes = 0;
+};
+
+// Returns the allocations made by the calling thread since it started.
+AllocationCount ThreadAllocations();
+
+// Calls 'fn' 'warmup' times, so that caches and buffers reach their steady state, then
+// 'iterations' more times, and returns the allocations made by the calling thread during
+// the latter.
+AllocationCount CountAllocations(const std::function<void()>& fn, int iterations,
+    int warmup = 10);
+
+}
+
+#endif
@@ -0,0 +1,27 @@
+"""Embeds Mustache templates in a binary."""
+
+def mustache_templates(name, srcs, function, strip_prefix = ""):
+    """Generates a cc_library that embeds 'srcs' in the binary.
+
+    The library's header, <name>.h, declares <function>(), which returns a
+    mustache::TemplateRegistry of the templates, named by their path with
+    'strip_prefix' removed.
+    """
+    native.genrule(
+        name = name + "-gen",
+        srcs = srcs,
+        outs = [name + ".h", name + ".cc"],
+        tools = ["//:mustache-embed"],
+        cmd = ("$(location //:mustache-embed) $(location {name}.h) $(location {name}.cc) " +
+               "{function} '{strip_prefix}' $(SRCS)").format(
+            name = name,
+            function = function,
+            strip_prefix = strip_prefix,
+        ),
+    )
+    native.cc_library(
+        name = name,
+        srcs = [name + ".cc"],
+        hdrs = [name + ".h"],
+        deps = ["//:mustache"],
+    )
@@ -0,0 +1,615 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "benchmark/benchmark.h"
+#include "allocation-counter.h"
+#include "mustache.h"
+#include "mustache-internal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mustache;
+using namespace std;
+
+// The checked-in corpus of templates. Like the tests, the benchmarks are run from the root
+// of the repository.
+static const char kCorpus[] = "bench-templates/";
+
+// Context generators for the templates of the corpus. Values are made up, but
+// deterministic, and sized like real pages.
+string LiteralContext() {
+  return "{ \"title\": \"Example article\", \"headline\": \"Something happened today\", "
+      "\"author\": \"A. Reporter\", \"year\": 2024 }";
+}
+
+// A comment thread 40 replies deep, with an extra reply every few levels.
+string NestedComment(int depth) {
+  stringstream ss;
+  ss << "{ \"id\": " << depth << ", \"author\": \"user" << depth << "\", \"moderator\": "
+     << (depth % 5 == 0 ? "true" : "false") << ", \"body\": \"Reply at depth " << depth
+     << "\", \"replies\": [";
+  if (depth < 40) {
+    ss << NestedComment(depth + 1);
+    if (depth % 4 == 0) {
+      ss << ", { \"id\": " << 1000 + depth << ", \"author\": \"lurker\", \"body\": "
+         << "\"Agreed.\", \"replies\": [] }";
+    }
+  }
+  ss << "] }";
+  return ss.str();
+}
+
+string NestedContext() {
+  return "{ \"comments\": [" + NestedComment(0) + "] }";
+}
+
+string RowsContext() {
+  static const char* const kStatuses[] = { "pending", "shipped", "delivered", "returned" };
+  stringstream ss;
+  ss << "{ \"rows\": [";
+  for (int i = 0; i < 100000; ++i) {
+    ss << (i == 0 ? "" : ",") << "{ \"id\": " << i << ", \"customer\": \"Customer "
+       << i % 1000 << "\", \"status\": \"" << kStatuses[i % 4] << "\", \"total\": "
+       << (i % 997) * 1.37 << ", \"flagged\": " << (i % 17 == 0 ? "true" : "false")
+       << " }";
+  }
+  ss << "] }";
+  return ss.str();
+}
+
+// User-generated content, where most characters need escaping.
+string EscapeContext() {
+  stringstream ss;
+  ss << "{ \"reviews\": [";
+  for (int i = 0; i < 1000; ++i) {
+    ss << (i == 0 ? "" : ",") << "{ \"title\": \"<b>5/5</b> \\\"Best\\\" & 'cheapest' #"
+       << i << "\", \"user\": { \"name\": \"Tom & Jerry's <shop>\", \"email\": "
+       << "\"tom+" << i << "@example.com\" }, \"text\": \"<script>alert('x' + \\\"y\\\")"
+       << "</script> & <img src=x onerror='z'> \\\"quoted\\\" <<>> &amp; & & ''\", "
+       << "\"query\": \"a&b=<c>&d='e'\" }";
+  }
+  ss << "] }";
+  return ss.str();
+}
+
+string LayoutContext() {
+  stringstream ss;
+  ss << "{ \"title\": \"Shoes\", \"user\": { \"name\": \"Ann\" }, \"site\": { \"name\": "
+     << "\"Example Store\", \"cdn\": \"https://cdn.example.com\", \"nav\": [";
+  for (int i = 0; i < 8; ++i) {
+    ss << (i == 0 ? "" : ",") << "{ \"href\": \"/c/" << i << "\", \"label\": \"Category "
+       << i << "\" }";
+  }
+  ss << "] }, \"products\": [";
+  for (int i = 0; i < 48; ++i) {
+    ss << (i == 0 ? "" : ",") << "{ \"href\": \"/p/" << i << "\", \"label\": \"Product "
+       << i << "\", \"image\": \"p" << i << ".jpg\", \"price\": \"$" << 20 + i << ".00\", ";
+    if (i % 3 == 0) ss << "\"sale\": \"$" << 15 + i << ".00\", ";
+    ss << "\"tags\": [\"new\", \"size " << 36 + i % 10 << "\", \"free shipping\"] }";
+  }
+  ss << "] }";
+  return ss.str();
+}
+
+string NumbersContext() {
+  stringstream ss;
+  ss << "{ \"series\": [";
+  for (int i = 0; i < 200; ++i) {
+    ss << (i == 0 ? "" : ",") << "{ \"name\": \"metric_" << i << "\", \"points\": [";
+    for (int j = 0; j < 50; ++j) {
+      ss << (j == 0 ? "" : ",");
+      if (j % 2 == 0) {
+        ss << i * 1000 + j * 37;
+      } else {
+        ss << (i * 50 + j) / 7.0;
+      }
+    }
+    ss << "] }";
+  }
+  ss << "] }";
+  return ss.str();
+}
+
+// Hardware performance counters of the calling thread and the threads it starts, read
+// with perf_event_open() on Linux, for ForEachIteration(). Counting starts when
+// constructed; Report() adds the counts per iteration, and instructions per cycle, to a
+// benchmark's counters. Events the CPU or kernel won't count, e.g. in a VM or with
+// kernel.perf_event_paranoid set to 3, are left out, and elsewhere nothing is reported.
+class HardwareCounters {
+ public:
+  HardwareCounters() {
+#ifdef __linux__
+    static const struct {
+      const char* name;
+      uint32_t type;
+      uint64_t config;
+    } kEvents[] = {
+      { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+      { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+      { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+      { "l1d_misses", PERF_TYPE_HW_CACHE, CacheReadMisses(PERF_COUNT_HW_CACHE_L1D) },
+      { "llc_misses", PERF_TYPE_HW_CACHE, CacheReadMisses(PERF_COUNT_HW_CACHE_LL) },
+      { "dtlb_misses", PERF_TYPE_HW_CACHE, CacheReadMisses(PERF_COUNT_HW_CACHE_DTLB) },
+    };
+    int error = 0;
+    for (const auto& event: kEvents) {
+      struct perf_event_attr attr = {};
+      attr.size = sizeof(attr);
+      attr.type = event.type;
+      attr.config = event.config;
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if (fd < 0) {
+        error = errno;
+        continue;
+      }
+      events_.push_back({ event.name, fd });
+    }
+    static atomic<bool> warned(false);
+    if (events_.empty() && !warned.exchange(true)) {
+      fprintf(stderr, "Not reporting hardware counters: perf_event_open: %s\n",
+          strerror(error));
+    }
+    for (const Event& event: events_) ioctl(event.fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+  }
+
+  ~HardwareCounters() {
+    for (const Event& event: events_) close(event.fd);
+  }
+
+  HardwareCounters(const HardwareCounters&) = delete;
+  HardwareCounters& operator=(const HardwareCounters&) = delete;
+
+  void Report(benchmark::State* state) {
+#ifdef __linux__
+    for (const Event& event: events_) ioctl(event.fd, PERF_EVENT_IOC_DISABLE, 0);
+    map<string, double> counts;
+    for (const Event& event: events_) {
+      // The count, and the times the event was enabled and counting. Events are
+      // multiplexed when there are more than the CPU has counters for, so the count is
+      // scaled up to the whole time.
+      uint64_t values[3];
+      if (read(event.fd, values, sizeof(values)) != sizeof(values) || values[2] == 0) {
+        continue;
+      }
+      counts[event.name] = static_cast<double>(values[0]) * values[1] / values[2];
+      state->counters[event.name] =
+          benchmark::Counter(counts[event.name], benchmark::Counter::kAvgIterations);
+    }
+    if (counts["cycles"] > 0 && counts.count("instructions") != 0) {
+      state->counters["ipc"] = benchmark::Counter(
+          counts["instructions"] / counts["cycles"], benchmark::Counter::kAvgThreads);
+    }
+#endif
+  }
+
+ private:
+#ifdef __linux__
+  static constexpr uint64_t CacheReadMisses(uint64_t cache) {
+    return cache | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+        PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+  }
+#endif
+
+  struct Event {
+    const char* name;
+    int fd;
+  };
+  vector<Event> events_;
+};
+
+// Runs 'body' once per iteration of 'state', i.e. in place of 'for (auto _ : state)', and
+// reports the hardware counters of the loop. Every benchmark's timed loop goes through
+// here. After state.SkipWithError(), no more iterations are run.
+template <typename Body>
+void ForEachIteration(benchmark::State& state, Body body) {
+  HardwareCounters counters;
+  for (auto _ : state) body();
+  counters.Report(&state);
+}
+
+// Renders the corpus template 'name' with the context from 'context_fn'. Reports the time
+// per render, output bytes per second and heap allocations per render.
+void BM_Corpus(benchmark::State& state, const char* name, string (*context_fn)()) {
+  TemplateRegistry registry(make_shared<FileTemplateSource>(kCorpus));
+  rapidjson::Document context;
+  context.Parse<0>(context_fn().c_str());
+  stringstream warmup;
+  if (context.HasParseError() || !registry.Render(name, context, &warmup)) {
+    state.SkipWithError("Can't render template; run from the root of the repository");
+    return;
+  }
+  int64_t bytes = 0;
+  AllocationCount before = ThreadAllocations();
+  ForEachIteration(state, [&]() {
+    stringstream ss;
+    registry.Render(name, context, &ss);
+    bytes += ss.tellp();
+  });
+  AllocationCount after = ThreadAllocations();
+  state.counters["allocs_per_render"] = benchmark::Counter(
+      after.allocations - before.allocations, benchmark::Counter::kAvgIterations);
+  state.counters["alloc_bytes_per_render"] = benchmark::Counter(
+      after.bytes - before.bytes, benchmark::Counter::kAvgIterations);
+  state.SetBytesProcessed(bytes);
+}
+BENCHMARK_CAPTURE(BM_Corpus, literal, "literal", LiteralContext);
+BENCHMARK_CAPTURE(BM_Corpus, nested, "nested", NestedContext);
+BENCHMARK_CAPTURE(BM_Corpus, rows, "rows", RowsContext)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Corpus, escape, "escape", EscapeContext);
+BENCHMARK_CAPTURE(BM_Corpus, layout, "layout", LayoutContext);
+BENCHMARK_CAPTURE(BM_Corpus, numbers, "numbers", NumbersContext);
+
+// The number of times the calling thread has blocked, e.g. waiting for a lock, or -1 if
+// that can't be told.
+int64_t ThreadContextSwitches() {
+#ifdef RUSAGE_THREAD
+  struct rusage usage;
+  if (getrusage(RUSAGE_THREAD, &usage) == 0) return usage.ru_nvcsw;
+#endif
+  return -1;
+}
+
+// Renders the corpus template 'name' from state.threads() threads at once. With
+// state.range(0) == 0 all threads share one registry, and so one copy of each compiled
+// template and its render counters; otherwise each thread compiles its own copies.
+// Reports the renders per second of each thread, and the scaling efficiency: that rate
+// relative to the rate of a single thread, from the single-threaded run of the same
+// benchmark. Also reports, per render, two signs of contention: heap allocations, which
+// contend in the allocator, and the number of times a thread blocked, e.g. on the lock
+// of a shared registry.
+void BM_Scaling(benchmark::State& state, const char* name, string (*context_fn)()) {
+  static mutex lock;
+  static map<string, shared_ptr<rapidjson::Document> > contexts;
+  static map<string, shared_ptr<TemplateRegistry> > shared_registries;
+  static map<pair<string, int64_t>, double> single_thread_rates;
+  shared_ptr<rapidjson::Document> context;
+  shared_ptr<TemplateRegistry> registry;
+  {
+    lock_guard<mutex> l(lock);
+    shared_ptr<rapidjson::Document>& parsed = contexts[name];
+    if (parsed == nullptr) {
+      parsed = make_shared<rapidjson::Document>();
+      parsed->Parse<0>(context_fn().c_str());
+    }
+    context = parsed;
+    shared_ptr<TemplateRegistry>& shared = shared_registries[name];
+    if (shared == nullptr) {
+      shared = make_shared<TemplateRegistry>(make_shared<FileTemplateSource>(kCorpus));
+    }
+    registry = shared;
+  }
+  if (state.range(0) != 0) {
+    CompileOptions options;
+    options.deduplicate = false;
+    registry = make_shared<TemplateRegistry>(make_shared<FileTemplateSource>(kCorpus),
+        false, options);
+  }
+  // Warm up into the closure tier.
+  for (int i = 0; i < 1000; ++i) {
+    stringstream ss;
+    if (!registry->Render(name, *context, &ss)) {
+      state.SkipWithError("Can't render template; run from the root of the repository");
+      return;
+    }
+  }
+
+  AllocationCount allocations = ThreadAllocations();
+  int64_t context_switches = ThreadContextSwitches();
+  auto start = chrono::steady_clock::now();
+  ForEachIteration(state, [&]() {
+    stringstream ss;
+    registry->Render(name, *context, &ss);
+  });
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  double rate = state.iterations() / seconds;
+  state.counters["renders_per_s_per_thread"] =
+      benchmark::Counter(rate, benchmark::Counter::kAvgThreads);
+  {
+    lock_guard<mutex> l(lock);
+    auto key = make_pair(string(name), state.range(0));
+    if (state.threads() == 1) single_thread_rates[key] = rate;
+    if (single_thread_rates.count(key) != 0) {
+      state.counters["efficiency"] = benchmark::Counter(rate / single_thread_rates[key],
+          benchmark::Counter::kAvgThreads);
+    }
+  }
+  state.counters["allocs_per_render"] = benchmark::Counter(
+      ThreadAllocations().allocations - allocations.allocations,
+      benchmark::Counter::kAvgIterations);
+  if (context_switches >= 0) {
+    state.counters["blocks_per_render"] = benchmark::Counter(
+        ThreadContextSwitches() - context_switches, benchmark::Counter::kAvgIterations);
+  }
+}
+
+// 1, 2, 4 ... threads, up to one per core.
+void ScalingThreads(benchmark::internal::Benchmark* b) {
+  int cores = max(1u, thread::hardware_concurrency());
+  for (int threads = 1; threads < cores; threads *= 2) b->Threads(threads);
+  b->Threads(cores);
+  b->DenseRange(0, 1)->UseRealTime();
+}
+BENCHMARK_CAPTURE(BM_Scaling, literal, "literal", LiteralContext)->Apply(ScalingThreads);
+BENCHMARK_CAPTURE(BM_Scaling, nested, "nested", NestedContext)->Apply(ScalingThreads);
+BENCHMARK_CAPTURE(BM_Scaling, escape, "escape", EscapeContext)->Apply(ScalingThreads);
+BENCHMARK_CAPTURE(BM_Scaling, layout, "layout", LayoutContext)->Apply(ScalingThreads);
+
+// Scans a document of state.range(0) bytes, with a tag every 32 bytes or so, for tags.
+void BM_FindNextTag(benchmark::State& state) {
+  string document;
+  while (document.size() < state.range(0)) {
+    document += "<li class=\"item\">{{#items}}{{name}}{{/items}}</li>\n";
+  }
+  document.resize(state.range(0));
+  ArrayView<char> view(document.data(), document.size());
+  ForEachIteration(state, [&]() {
+    stringstream text;
+    OpCtx op;
+    for (int idx = 0; idx < view.size(); ) idx = FindNextTag(view, idx, &op, &text);
+    benchmark::DoNotOptimize(text);
+  });
+  state.SetBytesProcessed(state.iterations() * document.size());
+}
+BENCHMARK(BM_FindNextTag)->RangeMultiplier(8)->Range(64, 256 << 10);
+
+// Escapes a string of state.range(0) characters, of which state.range(1) percent need
+// escaping.
+void BM_EscapeHtml(benchmark::State& state) {
+  static const char kSpecial[] = "<>&\"'";
+  string in;
+  for (int i = 0; i < state.range(0); ++i) {
+    in.push_back(i * 100 / state.range(0) % 100 < state.range(1) && i % 2 == 0 ?
+        kSpecial[i % 5] : 'a' + i % 26);
+  }
+  ForEachIteration(state, [&]() {
+    stringstream out;
+    EscapeHtml(in.data(), in.size(), &out);
+    benchmark::DoNotOptimize(out);
+  });
+  state.SetBytesProcessed(state.iterations() * in.size());
+}
+BENCHMARK(BM_EscapeHtml)
+    ->ArgsProduct({ benchmark::CreateRange(16, 64 << 10, 16), { 0, 10, 100 } });
+
+// Splits a path of state.range(0) components.
+void BM_FindJsonPathComponents(benchmark::State& state) {
+  string path = "component0";
+  for (int i = 1; i < state.range(0); ++i) path += ".component" + to_string(i);
+  ForEachIteration(state, [&]() {
+    vector<string> components;
+    FindJsonPathComponents(path, &components);
+    benchmark::DoNotOptimize(components);
+  });
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FindJsonPathComponents)->RangeMultiplier(2)->Range(1, 32);
+
+// Resolves a name through a context stack state.range(0) frames deep, each an object with
+// state.range(1) members. The name is the last member of the bottom frame, so every frame
+// is searched.
+void BM_ResolveJsonContext(benchmark::State& state) {
+  vector<rapidjson::Document> frames(state.range(0));
+  vector<ContextStack> stack(state.range(0));
+  for (int i = 0; i < state.range(0); ++i) {
+    string json = "{";
+    for (int j = 0; j < state.range(1); ++j) {
+      json += (j == 0 ? "\"" : ", \"") + to_string(i) + "_" + to_string(j) + "\": 1";
+    }
+    if (i == 0) json += string(state.range(1) == 0 ? "" : ", ") + "\"target\": 1";
+    frames[i].Parse<0>((json + "}").c_str());
+    stack[i] = { &frames[i], i == 0 ? nullptr : &stack[i - 1] };
+  }
+  ForEachIteration(state, [&]() {
+    const rapidjson::Value* resolved = nullptr;
+    ResolveJsonContext("target", &stack.back(), &resolved);
+    benchmark::DoNotOptimize(resolved);
+  });
+}
+BENCHMARK(BM_ResolveJsonContext)->ArgsProduct({ { 1, 4, 16, 64 }, { 1, 16, 256 } });
+
+// Writes 1000 numbers of one type: int (state.range(0) == 0), int64 or double.
+void BM_NumericOutput(benchmark::State& state) {
+  rapidjson::Document values;
+  values.SetArray();
+  for (int i = 0; i < 1000; ++i) {
+    rapidjson::Value value;
+    if (state.range(0) == 0) {
+      value.SetInt(i * 7919);
+    } else if (state.range(0) == 1) {
+      value.SetInt64(static_cast<int64_t>(i) * 1000000007LL * 1000);
+    } else {
+      value.SetDouble(i / 7.0);
+    }
+    values.PushBack(value, values.GetAllocator());
+  }
+  ForEachIteration(state, [&]() {
+    stringstream out;
+    for (int i = 0; i < 1000; ++i) EvaluateSubstitution(false, &values[i], &out);
+    benchmark::DoNotOptimize(out);
+  });
+  state.SetItemsProcessed(state.iterations() * 1000);
+}
+BENCHMARK(BM_NumericOutput)->DenseRange(0, 2);
+
+// A directory of generated templates, deleted when it goes out of scope.
+class TemplateDirectory {
+ public:
+  // Writes 'n' templates: a tenth are partials for shared page elements, and the rest
+  // are pages that each use several of them.
+  explicit TemplateDirectory(int n) {
+    char root[] = "/tmp/mustache-bench-XXXXXX";
+    root_ = mkdtemp(root);
+    root_ += "/";
+    int num_partials = max(1, n / 10);
+    for (int i = 0; i < num_partials; ++i) {
+      stringstream ss;
+      ss << "<div class=\"widget-" << i << "\">\n"
+         << "  {{#items}}<a href=\"{{url}}\">{{title}}</a> {{/items}}\n"
+         << "  {{^items}}<p>Nothing here yet.</p>{{/items}}\n"
+         << "</div>\n";
+      Write("partial" + to_string(i), ss.str());
+    }
+    for (int i = num_partials; i < n; ++i) {
+      stringstream ss;
+      ss << "<html><head><title>{{title}} - page " << i << "</title></head>\n<body>\n";
+      for (int j = 0; j < 4; ++j) ss << "{{>partial" << (i * 7 + j) % num_partials << "}}\n";
+      for (int j = 0; j < 20; ++j) {
+        ss << "<p class=\"para-" << j << "\">{{#user}}Hello {{name}}, you have "
+           << "{{unread}} messages.{{/user}} Lorem ipsum dolor sit amet.</p>\n";
+      }
+      ss << "</body></html>\n";
+      Write("page" + to_string(i), ss.str());
+    }
+  }
+
+  ~TemplateDirectory() {
+    for (const string& file: files_) unlink(file.c_str());
+    rmdir(root_.c_str());
+  }
+
+  const string& root() const { return root_; }
+
+ private:
+  void Write(const string& name, const string& contents) {
+    files_.push_back(root_ + name + ".mustache");
+    ofstream(files_.back().c_str()) << contents;
+  }
+
+  string root_;
+  vector<string> files_;
+};
+
+// Startup time: compiles a directory of state.range(0) templates on state.range(1)
+// threads. Also reports the memory used per compiled template.
+void BM_CompileDirectory(benchmark::State& state) {
+  TemplateDirectory directory(state.range(0));
+  CompileDirectoryReport report;
+  ForEachIteration(state, [&]() {
+    if (!CompileDirectory(directory.root(), state.range(1), &report)) {
+      state.SkipWithError("CompileDirectory failed");
+    }
+  });
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  size_t bytes = 0;
+  for (const string& name: report.templates) {
+    bytes += TemplateMemoryUsage(*FileTemplateRegistry(directory.root())->Get(name));
+  }
+  state.counters["bytes_per_template"] = bytes / max<size_t>(1, report.templates.size());
+}
+BENCHMARK(BM_CompileDirectory)
+    ->Args({ 10, 1 })->Args({ 10, 4 })
+    ->Args({ 100, 1 })->Args({ 100, 4 })
+    ->Args({ 1000, 1 })->Args({ 1000, 4 })
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// The string-based RenderTemplate() on a small page, with the render cache off
+// (state.range(0) == 0) and on.
+void BM_RenderTemplateString(benchmark::State& state) {
+  SetRenderCacheBudget(state.range(0) == 0 ? 0 : 64 << 20);
+  string page = "<html><head><title>{{title}}</title></head><body>\n";
+  for (int i = 0; i < 20; ++i) {
+    page += "<p>{{#user}}Hello {{name}}, you have {{unread}} messages.{{/user}}</p>\n";
+  }
+  page += "</body></html>\n";
+  rapidjson::Document context;
+  context.Parse<0>("{ \"title\": \"Inbox\", "
+      "\"user\": { \"name\": \"Ann\", \"unread\": 3 } }");
+  ForEachIteration(state, [&]() {
+    stringstream ss;
+    RenderTemplate(page, "", context, &ss);
+    benchmark::DoNotOptimize(ss);
+  });
+  SetRenderCacheBudget(0);
+}
+BENCHMARK(BM_RenderTemplateString)->Arg(0)->Arg(1);
+
+// Dispatch overhead: renders a table of many small ops with switch (state.range(0) == 0)
+// and threaded dispatch.
+void BM_Dispatch(benchmark::State& state) {
+  CompiledTemplate tmpl;
+  CompileTemplate("{{#rows}}<tr>{{#cells}}<td>{{.}}</td>{{/cells}}{{^cells}}-{{/cells}}"
+      "{{#odd}} odd{{/odd}}</tr>\n{{/rows}}", "", &tmpl);
+  string json = "{ \"rows\": [";
+  for (int i = 0; i < 1000; ++i) {
+    json += string(i == 0 ? "" : ",") + "{ \"odd\": " + (i % 2 ? "true" : "false") +
+        ", \"cells\": [1, 2, 3, 4, 5] }";
+  }
+  json += "] }";
+  rapidjson::Document context;
+  context.Parse<0>(json.c_str());
+  DispatchMode default_mode = GetDispatchMode();
+  SetDispatchMode(state.range(0) == 0 ? kSwitchDispatch : kThreadedDispatch);
+  SetClosureTierThreshold(0);
+  ForEachIteration(state, [&]() {
+    stringstream ss;
+    RenderTemplate(tmpl, context, &ss);
+    benchmark::DoNotOptimize(ss);
+  });
+  SetDispatchMode(default_mode);
+  SetClosureTierThreshold(1000);
+  // Ops evaluated per render: for each row, 4 for the row, 1 for the cells section and
+  // 3 per cell, plus 2 for the odd section on odd rows.
+  state.SetItemsProcessed(state.iterations() * 1000 * (4 + 1 + 15 + 1));
+}
+BENCHMARK(BM_Dispatch)->Arg(0)->Arg(1);
+
+// The same table rendered by the interpreter (state.range(0) == 0) and by the closure
+// tier.
+void BM_ClosureTier(benchmark::State& state) {
+  CompiledTemplate tmpl;
+  CompileTemplate("{{#rows}}<tr>{{#cells}}<td>{{.}}</td>{{/cells}}{{^cells}}-{{/cells}}"
+      "{{#odd}} odd{{/odd}}</tr>\n{{/rows}}", "", &tmpl);
+  string json = "{ \"rows\": [";
+  for (int i = 0; i < 1000; ++i) {
+    json += string(i == 0 ? "" : ",") + "{ \"odd\": " + (i % 2 ? "true" : "false") +
+        ", \"cells\": [1, 2, 3, 4, 5] }";
+  }
+  json += "] }";
+  rapidjson::Document context;
+  context.Parse<0>(json.c_str());
+  SetClosureTierThreshold(state.range(0) == 0 ? 0 : 1);
+  ForEachIteration(state, [&]() {
+    stringstream ss;
+    RenderTemplate(tmpl, context, &ss);
+    benchmark::DoNotOptimize(ss);
+  });
+  SetClosureTierThreshold(1000);
+  state.SetItemsProcessed(state.iterations() * 1000 * (4 + 1 + 15 + 1));
+}
+BENCHMARK(BM_ClosureTier)->Arg(0)->Arg(1);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,56 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compiles a set of templates, and every partial they refer to that wasn't inlined, into
+// a template bundle that can be loaded with mustache::LoadTemplateBundle().
+//
+// Usage: mustache-bundle <output> <root> <name>...
+
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mustache.h"
+
+using namespace mustache;
+using namespace std;
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    cerr << "Usage: " << argv[0] << " <output> <root> <name>..." << endl;
+    return 1;
+  }
+  TemplateRegistry registry(make_shared<FileTemplateSource>(argv[2]));
+  map<string, shared_ptr<const CompiledTemplate> > templates;
+  vector<string> pending(argv + 3, argv + argc);
+  while (!pending.empty()) {
+    string name = pending.back();
+    pending.pop_back();
+    if (templates.count(name) != 0) continue;
+    shared_ptr<const CompiledTemplate> tmpl = registry.Get(name);
+    if (tmpl == nullptr) {
+      cerr << "Could not compile template: " << name << endl;
+      return 1;
+    }
+    templates[name] = tmpl;
+    for (const TemplateOp& op: tmpl->ops) {
+      if (op.op == PARTIAL) pending.push_back(tmpl->str(op.text));
+    }
+  }
+  if (!WriteTemplateBundle(argv[1], templates)) {
+    cerr << "Could not write " << argv[1] << endl;
+    return 1;
+  }
+  return 0;
+}
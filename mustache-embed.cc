@@ -0,0 +1,114 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Generates a C++ header and source file that embed a set of templates in a binary. The
+// source defines a function returning a mustache::TemplateRegistry over the templates,
+// each named by its path with <strip-prefix> removed.
+//
+// Usage: mustache-embed <output.h> <output.cc> <function> <strip-prefix> <file>...
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Writes 'contents' as a sequence of C++ string literals, one per line of the input.
+void WriteStringLiteral(const string& contents, ostream* out) {
+  (*out) << "    \"";
+  for (int i = 0; i < contents.size(); ++i) {
+    unsigned char c = contents[i];
+    switch (c) {
+      case '\\': (*out) << "\\\\";
+        break;
+      case '"': (*out) << "\\\"";
+        break;
+      case '?': (*out) << "\\?"; // Avoid trigraphs
+        break;
+      case '\n':
+        (*out) << "\\n\"";
+        if (i + 1 < contents.size()) (*out) << "\n    \"";
+        continue;
+      default:
+        if (c < 0x20 || c >= 0x7f) {
+          char escaped[5];
+          snprintf(escaped, sizeof(escaped), "\\%03o", c);
+          (*out) << escaped;
+        } else {
+          (*out) << c;
+        }
+        break;
+    }
+    if (i + 1 == contents.size()) (*out) << "\"";
+  }
+  if (contents.empty()) (*out) << "\"";
+}
+
+int main(int argc, char** argv) {
+  if (argc < 5) {
+    cerr << "Usage: " << argv[0]
+         << " <output.h> <output.cc> <function> <strip-prefix> <file>..." << endl;
+    return 1;
+  }
+  const string function = argv[3];
+  const string strip_prefix = argv[4];
+
+  ofstream header(argv[1]);
+  header << "// Generated by mustache-embed. Do not edit.\n\n"
+         << "#pragma once\n\n"
+         << "#include \"mustache.h\"\n\n"
+         << "// Returns a registry of the embedded templates.\n"
+         << "mustache::TemplateRegistry* " << function << "();\n";
+
+  stringstream templates;
+  ofstream source(argv[2]);
+  source << "// Generated by mustache-embed. Do not edit.\n\n"
+         << "#include \"mustache.h\"\n\n"
+         << "namespace {\n\n";
+  for (int i = 5; i < argc; ++i) {
+    ifstream file(argv[i], ios::binary);
+    if (!file.is_open()) {
+      cerr << "Could not open " << argv[i] << endl;
+      return 1;
+    }
+    stringstream contents;
+    contents << file.rdbuf();
+    string name = argv[i];
+    if (name.compare(0, strip_prefix.size(), strip_prefix) == 0) {
+      name = name.substr(strip_prefix.size());
+    }
+
+    source << "// " << name << "\n"
+           << "const char kTemplate" << i - 5 << "[] =\n";
+    WriteStringLiteral(contents.str(), &source);
+    source << ";\n\n";
+    templates << "  { \"";
+    for (char c: name) templates << (c == '"' || c == '\\' ? "\\" : "") << c;
+    templates << "\", kTemplate" << i - 5 << ", " << contents.str().size() << " },\n";
+  }
+
+  source << "const mustache::EmbeddedTemplate kTemplates[] = {\n"
+         << templates.str()
+         << "  { nullptr, nullptr, 0 }\n"
+         << "};\n\n"
+         << "}\n\n"
+         << "mustache::TemplateRegistry* " << function << "() {\n"
+         << "  static mustache::TemplateRegistry* registry = new mustache::TemplateRegistry(\n"
+         << "      std::make_shared<mustache::EmbeddedTemplateSource>(kTemplates, "
+         << argc - 5 << "));\n"
+         << "  return registry;\n"
+         << "}\n";
+  return header.good() && source.good() ? 0 : 1;
+}
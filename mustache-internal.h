@@ -0,0 +1,58 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MUSTACHE_INTERNAL_H
+#define MUSTACHE_INTERNAL_H
+
+#include "mustache.h"
+#include "rapidjson/document.h"
+#include <stdint.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Internals of mustache.cc that the tests and benchmarks use directly; not part of the
+// API.
+namespace mustache {
+
+// A tag found by FindNextTag().
+struct OpCtx {
+  TagOperator op;
+  std::string tag_name;
+  std::string tag_arg;
+  bool escaped = false;
+
+  // The offset of the tag in the document.
+  int offset = -1;
+};
+
+// A level of context while rendering: the value that names are looked up in, and the
+// enclosing level, searched if they aren't found.
+struct ContextStack {
+  const rapidjson::Value* value;
+  const ContextStack* parent;
+};
+
+// Stages of compiling and rendering, documented with their definitions in mustache.cc.
+int FindNextTag(const ArrayView<char>& document, int idx, OpCtx* op,
+    std::stringstream* out);
+void EscapeHtml(const char* in, size_t length, std::stringstream* out);
+void FindJsonPathComponents(const std::string& path,
+    std::vector<std::string>* components);
+void ResolveJsonContext(const std::string& path, const ContextStack* stack,
+    const rapidjson::Value** resolved);
+void EvaluateSubstitution(bool escaped, const rapidjson::Value* val,
+    std::stringstream* out);
+
+}
+
+#endif
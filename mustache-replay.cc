@@ -0,0 +1,122 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reruns a render captured by mustache::SetSlowRenderCapture() under Google Benchmark, to
+// reproduce a slow render. The template is loaded by name, through a TemplateRegistry of
+// the files under <root>, and rendered with the captured context by
+// TemplateRegistry::Render(), as the captured render was. Prints where a profiled render
+// spends its time next to the capture's own profile, then benchmarks the render; any
+// Google Benchmark flags are passed on.
+//
+// Captures only record the template's name, so only templates that were loaded from
+// files can be replayed: those of registries with an in-memory source, or of embedded
+// templates, can't be found under <root>.
+//
+// Usage: mustache-replay <capture> <root> [--benchmark_...]
+
+#include <benchmark/benchmark.h>
+#include <stdio.h>
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "mustache.h"
+#include "rapidjson/document.h"
+
+using namespace mustache;
+using namespace rapidjson;
+using namespace std;
+
+// Prints the 'count' slowest tags of 'tags', a json array of captured TagStats, or of
+// 'stats' if 'tags' is null.
+void PrintTags(const Value* tags, const RenderStats* stats, int count) {
+  printf("  %12s %8s %12s  %s\n", "us", "count", "bytes", "tag");
+  if (tags != nullptr) {
+    for (SizeType i = 0; i < tags->Size() && i < count; ++i) {
+      const Value& tag = (*tags)[i];
+      printf("  %12.1f %8lld %12lld  %s %s\n", tag["nanoseconds"].GetInt64() / 1e3,
+          static_cast<long long>(tag["count"].GetInt64()),
+          static_cast<long long>(tag["bytes"].GetInt64()), tag["template"].GetString(),
+          tag["tag"].GetString());
+    }
+    return;
+  }
+  for (int i = 0; i < stats->tags.size() && i < count; ++i) {
+    const TagStats& tag = stats->tags[i];
+    printf("  %12.1f %8lld %12lld  %s %s\n", tag.nanoseconds / 1e3,
+        static_cast<long long>(tag.count), static_cast<long long>(tag.bytes),
+        tag.template_name.c_str(), tag.tag.c_str());
+  }
+}
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  if (argc != 3) {
+    cerr << "Usage: " << argv[0] << " <capture> <root> [--benchmark_...]" << endl;
+    return 1;
+  }
+  ifstream file(argv[1]);
+  string json((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  Document capture;
+  capture.Parse<0>(json.c_str());
+  if (capture.HasParseError() || !capture.IsObject() || !capture.HasMember("template") ||
+      !capture.HasMember("context")) {
+    cerr << "Not a capture: " << argv[1] << endl;
+    return 1;
+  }
+  string name = capture["template"].GetString();
+  const Value& context = capture["context"];
+
+  string root = argv[2];
+  if (!root.empty() && root[root.size() - 1] != '/') root += '/';
+  TemplateRegistry registry(make_shared<FileTemplateSource>(root));
+  shared_ptr<const CompiledTemplate> tmpl = registry.Get(name);
+  if (tmpl == nullptr) {
+    cerr << "Could not load template " << name << " from " << root << endl
+         << "Templates from in-memory or embedded registries can't be replayed." << endl;
+    return 1;
+  }
+  char fingerprint[17];
+  snprintf(fingerprint, sizeof(fingerprint), "%016llx",
+      static_cast<unsigned long long>(TemplateFingerprint(*tmpl)));
+  if (capture.HasMember("fingerprint") &&
+      fingerprint != string(capture["fingerprint"].GetString())) {
+    cerr << "Warning: " << name << " has changed since it was captured" << endl;
+  }
+
+  if (capture.HasMember("stats")) {
+    printf("Captured: %.1f us, %lld bytes\n", capture["nanoseconds"].GetInt64() / 1e3,
+        static_cast<long long>(capture["bytes"].GetInt64()));
+    PrintTags(&capture["stats"]["tags"], nullptr, 10);
+  }
+  stringstream ss;
+  RenderStats stats;
+  registry.Render(name, context, &ss, &stats);
+  printf("Replayed: %.1f us, %lld bytes\n", stats.nanoseconds / 1e3,
+      static_cast<long long>(stats.bytes));
+  PrintTags(nullptr, &stats, 10);
+
+  benchmark::RegisterBenchmark(("BM_Replay/" + name).c_str(),
+      [&](benchmark::State& state) {
+        for (auto _ : state) {
+          stringstream out;
+          registry.Render(name, context, &out);
+        }
+        state.SetBytesProcessed(state.iterations() * stats.bytes);
+      })->Unit(benchmark::kMicrosecond);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -1,18 +1,24 @@
 #include "gtest/gtest.h"
 #include "rapidjson/document.h"
+#include "allocation-counter.h"
 #include "mustache.h"
+#include "mustache-internal.h"
+#include "embedded_test_templates.h"
 
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
 #include <vector>
 
 using namespace rapidjson;
 using namespace std;
 using namespace mustache;
 
-namespace mustache {
-
-void FindJsonPathComponents(const string& path, vector<string>* components);
-
-}
 //////////////////////////////////////////////////////////////////////////////////////////
 // FindJsonPathComponents
 
@@ -55,6 +61,40 @@ void TestTemplate(const string& tmpl, const string& json_context,
                                                        << endl << "Template: " << tmpl
                                                        << ", json: " << json_context;
   ASSERT_EQ(expected, ss.str()) << "Template: " << tmpl << ", json: " << json_context;
+
+  // The unoptimized evaluator must agree.
+  CompileOptions options;
+  options.optimize = false;
+  CompiledTemplate compiled;
+  ASSERT_TRUE(CompileTemplate(tmpl, "", &compiled, options));
+  ASSERT_TRUE(compiled.slots.empty());
+  stringstream unoptimized;
+  ASSERT_TRUE(RenderTemplate(compiled, document, &unoptimized));
+  ASSERT_EQ(expected, unoptimized.str()) << "Unoptimized template: " << tmpl;
+
+  // So must both ways of dispatching ops.
+  ASSERT_TRUE(CompileTemplate(tmpl, "", &compiled));
+  DispatchMode default_mode = GetDispatchMode();
+  for (DispatchMode mode: { kSwitchDispatch, kThreadedDispatch }) {
+    SetDispatchMode(mode);
+    stringstream dispatched;
+    bool rendered = RenderTemplate(compiled, document, &dispatched);
+    SetDispatchMode(default_mode);
+    ASSERT_TRUE(rendered);
+    ASSERT_EQ(expected, dispatched.str()) << "Dispatch mode " << mode << ": " << tmpl;
+  }
+
+  // And the closure tier, both with and without path slots.
+  SetClosureTierThreshold(1);
+  for (bool optimize: { false, true }) {
+    options.optimize = optimize;
+    CompiledTemplate hot;
+    ASSERT_TRUE(CompileTemplate(tmpl, "", &hot, options));
+    stringstream closures;
+    ASSERT_TRUE(RenderTemplate(hot, document, &closures));
+    ASSERT_EQ(expected, closures.str()) << "Closure tier: " << tmpl;
+  }
+  SetClosureTierThreshold(1000);
 }
 
 void TestTemplateExpectError(const string& tmpl, const string& json_context) {
@@ -223,10 +263,829 @@ TEST(RenderTemplate, NestedTemplatesWithSameTag) {
   TestTemplate("{{?b}}{{#b}}{{/b}}{{/b}}Hello", "{  }", "Hello");
 }
 
+TEST(RenderTemplate, HoistedPaths) {
+  // 'site.currency' comes from the outer context for rows that don't shadow it.
+  TestTemplate("{{#rows}}{{site.currency}}{{/rows}}",
+      "{ \"site\": { \"currency\": \"$\" }, \"rows\": [ 1, "
+      "{ \"site\": { \"currency\": \"EUR\" } }, { \"site\": 2 }, 3 ] }",
+      "$EUR$$");
+  TestTemplate("{{#a}}{{#b}}{{x}}{{/b}}{{/a}}",
+      "{ \"x\": 1, \"a\": [ { \"b\": [ 1, { \"x\": 2 } ] }, { \"x\": 3, \"b\": [ 4 ] } ] }",
+      "123");
+  TestTemplate("{{user.name}}{{#user}}{{name}}{{user.name}}{{/user}}{{user.name}}",
+      "{ \"user\": { \"name\": \"a\" } }", "aaaa");
+
+  // Repeated paths in the same scope share a slot, which is hoisted into every enclosing
+  // scope.
+  CompiledTemplate compiled;
+  ASSERT_TRUE(CompileTemplate("{{a.b}}{{a.b}}{{#c}}{{a.b}}{{d}}{{/c}}", "", &compiled));
+  EXPECT_EQ(5, compiled.slots.size());
+  EXPECT_EQ(compiled.ops[0].slot, compiled.ops[1].slot);
+}
+
+TEST(RenderTemplate, CompactLayout) {
+  // Every string is stored once, and strings that end another, like the last component
+  // of a path, point into it: the pool is just "a.bc\0a\0".
+  CompiledTemplate compiled;
+  ASSERT_TRUE(CompileTemplate("{{a.bc}}{{bc}}{{a}}", "", &compiled));
+  EXPECT_EQ(7, compiled.pool.size());
+  EXPECT_STREQ("bc", compiled.str(compiled.ops[1].text));
+  EXPECT_EQ(compiled.pool.data() + 2, compiled.str(compiled.ops[1].text));
+  // The packed form is a 16-byte header, fixed-size records, a source offset and an
+  // opcode byte per op and the pool, with nothing in between.
+  EXPECT_EQ(32, sizeof(TemplateOp));
+  EXPECT_EQ(16 + 3 * sizeof(TemplateOp) + compiled.slots.size() * sizeof(PathSlot) +
+      compiled.components.size() * sizeof(uint32_t) + 3 * 4 + 3 + 7,
+      compiled.packed.size());
+  EXPECT_EQ(vector<uint32_t>({ 0, 8, 14 }),
+      vector<uint32_t>(compiled.offsets.begin(), compiled.offsets.end()));
+  EXPECT_LT(compiled.packed.size(), TemplateMemoryUsage(compiled));
+}
+
+TEST(RenderTemplate, SteadyStateDoesNotAllocate) {
+  string json = "{ \"title\": \"<Home> & \\\"away\\\", with a long title\", "
+      "\"rows\": [";
+  for (int i = 0; i < 100; ++i) {
+    json += string(i == 0 ? "" : ", ") + "{ \"name\": \"row <b>" + to_string(i) +
+        "</b> with a long name\", \"n\": " + to_string(i) + ", \"x\": 1.5, "
+        "\"on\": true, \"tags\": [\"a\", \"b\"] }";
+  }
+  Document document;
+  document.Parse<0>((json + "] }").c_str());
+  ASSERT_FALSE(document.HasParseError());
+  // Loops, substitution of strings and numbers, and escaping.
+  CompiledTemplate tmpl;
+  ASSERT_TRUE(CompileTemplate("<h1>{{title}}</h1>{{#rows}}<tr>{{name}} {{{name}}} {{n}} "
+      "{{x}} {{#on}}on{{/on}}{{^off}}off{{/off}} {{#tags}}{{.}}{{/tags}} {{title}}</tr>"
+      "{{/rows}}{{%rows}}", "", &tmpl));
+
+  // Once the output buffer is big enough, renders allocate nothing, in either tier and
+  // with either dispatch mode.
+  DispatchMode default_mode = GetDispatchMode();
+  for (int threshold: { 0, 1 }) {
+    for (DispatchMode mode: { kSwitchDispatch, kThreadedDispatch }) {
+      SetClosureTierThreshold(threshold);
+      SetDispatchMode(mode);
+      stringstream ss;
+      AllocationCount count = CountAllocations([&]() {
+        ss.seekp(0);
+        RenderTemplate(tmpl, document, &ss);
+      }, 100);
+      EXPECT_EQ(0, count.allocations) << "threshold " << threshold << ", mode " << mode;
+      EXPECT_EQ(0, count.bytes);
+    }
+  }
+  SetClosureTierThreshold(1000);
+  SetDispatchMode(default_mode);
+
+  // Whereas a new output stream has to grow its buffer.
+  EXPECT_LT(0, CountAllocations([&]() {
+    stringstream ss;
+    RenderTemplate(tmpl, document, &ss);
+  }, 1).allocations);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Specialize
+
+// Specializes 'tmpl' against 'static_json', renders the result with 'dynamic_json' and
+// checks the output. Returns the number of ops left after specialization.
+int TestSpecialized(const string& tmpl, const string& static_json,
+    const string& dynamic_json, const string& expected) {
+  Document static_context;
+  static_context.Parse<0>(static_json.c_str());
+  Document dynamic_context;
+  dynamic_context.Parse<0>(dynamic_json.c_str());
+  CompiledTemplate compiled;
+  EXPECT_TRUE(CompileTemplate(tmpl, "", &compiled)) << tmpl;
+  CompiledTemplate specialized;
+  EXPECT_TRUE(Specialize(compiled, static_context, &specialized)) << tmpl;
+  stringstream ss;
+  EXPECT_TRUE(RenderTemplate(specialized, dynamic_context, &ss));
+  EXPECT_EQ(expected, ss.str()) << "Template: " << tmpl << ", static json: "
+                                << static_json << ", json: " << dynamic_json;
+  return specialized.ops.size();
+}
+
+TEST(Specialize, FoldsStaticTags) {
+  EXPECT_EQ(1, TestSpecialized("<{{site.name}}> {{%nav}} {{{raw}}}",
+      "{ \"site\": { \"name\": \"a&b\" }, \"nav\": [1, 2], \"raw\": \"<b>\" }",
+      "{ }", "<a&amp;b> 2 <b>"));
+  EXPECT_EQ(3, TestSpecialized("{{site.name}} {{user}}!", "{ \"site\": { \"name\": 1 } }",
+      "{ \"user\": \"bob\" }", "1 bob!"));
+}
+
+TEST(Specialize, FoldsStaticSections) {
+  EXPECT_EQ(1, TestSpecialized("{{#nav}}<{{.}}>{{/nav}}{{^off}}on{{/off}}{{#off}}x{{/off}}",
+      "{ \"nav\": [\"a\", \"b\"], \"off\": false }", "{ }", "<a><b>on"));
+  EXPECT_EQ(1, TestSpecialized("{{=locale en}}Hello{{/locale}}{{=locale fr}}Salut{{/locale}}",
+      "{ \"locale\": \"en\" }", "{ }", "Hello"));
+  // Predicate sections with an unknown condition keep the condition, but their contents
+  // are still specialized.
+  EXPECT_EQ(4, TestSpecialized("{{?user}}{{site}} {{user}}{{/user}}", "{ \"site\": 1 }",
+      "{ \"user\": 2 }", "1 2"));
+}
+
+TEST(Specialize, KeepsDynamicSections) {
+  // 'name' may come from each row, so the loop can't be folded.
+  TestSpecialized("{{#rows}}{{name}}{{/rows}}", "{ \"name\": \"s\" }",
+      "{ \"rows\": [ { \"name\": \"a\" }, { } ] }", "as");
+  // A static section that contains a dynamic tag is kept whole.
+  TestSpecialized("{{#nav}}{{.}}{{user}}{{/nav}}", "{ \"nav\": [1, 2] }",
+      "{ \"user\": \"u\" }", "1u2u");
+  // Static values take precedence over dynamic ones.
+  TestSpecialized("{{a}}", "{ \"a\": 1 }", "{ \"a\": 2 }", "1");
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// TemplateRegistry
+
+// Counts the number of times each template is read.
+class CountingTemplateSource : public MemoryTemplateSource {
+ public:
+  virtual bool Read(const string& name, string* contents) {
+    ++reads[name];
+    return MemoryTemplateSource::Read(name, contents);
+  }
+  map<string, int> reads;
+};
+
+TEST(RenderTemplate, RenderCache) {
+  SetRenderCacheBudget(1 << 20);
+  RenderCacheStats before = GetRenderCacheStats();
+  Document document;
+  document.Parse<0>("{ \"a\": 1 }");
+  stringstream ss;
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(RenderTemplate("<{{a}}>", "", document, &ss));
+    EXPECT_FALSE(RenderTemplate("{{#a}}{{/b}}", "", document, &ss));
+  }
+  EXPECT_EQ("<1><1>", ss.str());
+  RenderCacheStats after = GetRenderCacheStats();
+  EXPECT_EQ(2, after.hits - before.hits);
+  EXPECT_EQ(2, after.misses - before.misses);
+
+  // Templates are evicted to stay within the budget.
+  SetRenderCacheBudget(16 * 1024);
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(RenderTemplate("{{a}}" + to_string(i), "", document, &ss));
+  }
+  after = GetRenderCacheStats();
+  EXPECT_LE(after.bytes, 16 * 1024);
+  EXPECT_GT(after.evictions, before.evictions);
+
+  SetRenderCacheBudget(0);
+  EXPECT_EQ(0, GetRenderCacheStats().bytes);
+}
+
+TEST(RenderTemplate, PicksUpPartialChanges) {
+  char root[] = "/tmp/mustache-test-XXXXXX";
+  ASSERT_TRUE(mkdtemp(root) != nullptr);
+  string dir = string(root) + "/";
+  Document document;
+  document.Parse<0>("{ }");
+  CompileOptions options;
+  options.check_for_updates = true;
+  CompiledTemplate checked;
+  ASSERT_TRUE(CompileTemplate("[{{>row}}]", dir, &checked, options));
+  CompiledTemplate unchecked;
+  ASSERT_TRUE(CompileTemplate("[{{>row}}]", dir, &unchecked));
+  stringstream ss;
+  stringstream ss_unchecked;
+  // Partials are checked for changes, including ones that didn't exist, if asked to be.
+  // Otherwise what was found first is kept.
+  ASSERT_TRUE(RenderTemplate(checked, document, &ss));
+  ASSERT_TRUE(RenderTemplate(unchecked, document, &ss_unchecked));
+  ofstream(dir + "row.mustache") << "one";
+  ASSERT_TRUE(RenderTemplate(checked, document, &ss));
+  ASSERT_TRUE(RenderTemplate(unchecked, document, &ss_unchecked));
+  ofstream(dir + "row.mustache") << "three";
+  ASSERT_TRUE(RenderTemplate(checked, document, &ss));
+  ASSERT_TRUE(RenderTemplate(unchecked, document, &ss_unchecked));
+  EXPECT_EQ("[][one][three]", ss.str());
+  EXPECT_EQ("[][][]", ss_unchecked.str());
+  unlink((dir + "row.mustache").c_str());
+  rmdir(root);
+}
+
+TEST(TemplateRegistry, CachesPartials) {
+  shared_ptr<CountingTemplateSource> source = make_shared<CountingTemplateSource>();
+  source->Add("page", "{{#rows}}{{>row}}{{/rows}}{{>missing}}");
+  source->Add("row", "<{{.}}>");
+  TemplateRegistry registry(source);
+  Document document;
+  document.Parse<0>("{ \"rows\": [1, 2, 3] }");
+  for (int i = 0; i < 2; ++i) {
+    stringstream ss;
+    ASSERT_TRUE(registry.Render("page", document, &ss));
+    EXPECT_EQ("<1><2><3>", ss.str());
+  }
+  EXPECT_EQ(1, source->reads["page"]);
+  EXPECT_EQ(1, source->reads["row"]);
+  EXPECT_EQ(1, source->reads["missing"]);
+  EXPECT_TRUE(registry.Get("missing") == nullptr);
+}
+
+TEST(TemplateRegistry, Freeze) {
+  shared_ptr<CountingTemplateSource> source = make_shared<CountingTemplateSource>();
+  source->Add("page", "<h1>{{title}}</h1>");
+  source->Add("row", "<li>{{name}}</li>");
+  TemplateRegistry registry(source);
+  ASSERT_TRUE(registry.Get("page") != nullptr);
+  registry.Freeze();
+
+  // Only what was loaded before is there, and nothing can change it.
+  EXPECT_TRUE(registry.Get("page") != nullptr);
+  EXPECT_TRUE(registry.Get("row") == nullptr);
+  EXPECT_EQ(0, source->reads["row"]);
+  EXPECT_TRUE(registry.Compile("row", "<li>{{name}}</li>") == nullptr);
+  EXPECT_FALSE(registry.Add("row", registry.Get("page")));
+  EXPECT_FALSE(registry.Clear());
+  EXPECT_TRUE(registry.Get("row") == nullptr);
+  EXPECT_TRUE(registry.Get("page") != nullptr);
+}
+
+TEST(TemplateRegistry, InlinesPartials) {
+  shared_ptr<MemoryTemplateSource> source = make_shared<MemoryTemplateSource>();
+  source->Add("page", "<ul>{{#nodes}}{{>node}}{{/nodes}}</ul>");
+  source->Add("node", "<li>{{name}}{{#children}}{{>node}}{{/children}}</li>");
+  source->Add("big", "{{a}}-{{b}}-{{c}}");
+  source->Add("uses-big", "{{>big}}");
+  source->Add("small", "{{a}}");
+  source->Add("uses-small", "<>{{>small}}");
+  CompileOptions options;
+  options.max_inline_ops = 4;
+  TemplateRegistry registry(source, false, options);
+
+  // 'node' is recursive, so is inlined into 'page' but calls itself.
+  shared_ptr<const CompiledTemplate> page = registry.Get("page");
+  ASSERT_TRUE(page != nullptr);
+  int partials = 0;
+  for (const TemplateOp& op: page->ops) partials += (op.op == PARTIAL);
+  EXPECT_EQ(1, partials);
+
+  Document document;
+  document.Parse<0>("{ \"nodes\": [ { \"name\": \"a\", \"children\": "
+      "[ { \"name\": \"b\", \"children\": [] } ] } ] }");
+  stringstream ss;
+  ASSERT_TRUE(registry.Render("page", document, &ss));
+  EXPECT_EQ("<ul><li>a<li>b</li></li></ul>", ss.str());
+
+  // 'big' is over the size limit.
+  EXPECT_EQ(PARTIAL, registry.Get("uses-big")->ops[0].op);
+
+  // 'small' isn't, and its tags are placed at the partial tag.
+  shared_ptr<const CompiledTemplate> uses_small = registry.Get("uses-small");
+  ASSERT_EQ(2, uses_small->ops.size());
+  EXPECT_EQ(SUBSTITUTION, uses_small->ops[1].op);
+  EXPECT_EQ(2, uses_small->offsets[1]);
+}
+
+TEST(TemplateRegistry, DepthLimit) {
+  shared_ptr<MemoryTemplateSource> source = make_shared<MemoryTemplateSource>();
+  source->Add("loop", "x{{>loop}}");
+  source->Add("node", "{{#n}}x{{>node}}{{/n}}");
+  TemplateRegistry registry(source);
+
+  // Deep data renders without running out of stack.
+  string json;
+  for (int i = 0; i < 3000; ++i) json += "{ \"n\": ";
+  json += "false";
+  for (int i = 0; i < 3000; ++i) json += " }";
+  Document document;
+  document.Parse<0>(json.c_str());
+  // Once through each tier; past a few levels, the closure tier hands over to the
+  // interpreter.
+  for (int threshold: { 1000, 1, 1 }) {
+    SetClosureTierThreshold(threshold);
+    stringstream ss;
+    ASSERT_TRUE(registry.Render("node", document, &ss));
+    EXPECT_EQ(string(2999, 'x'), ss.str());
+
+    // Unbounded recursion fails cleanly at the limit.
+    SetMaxRenderDepth(100);
+    ss.str("");
+    EXPECT_FALSE(registry.Render("loop", document, &ss));
+    EXPECT_EQ(string(100, 'x'), ss.str());
+    SetMaxRenderDepth(10000);
+  }
+  SetClosureTierThreshold(1000);
+}
+
+// Runs 'fn' on a thread with a stack of only 'stack_size' bytes.
+void RunOnSmallStack(size_t stack_size, const function<void()>& fn) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, stack_size);
+  pthread_t thread;
+  auto run = [](void* arg) -> void* {
+    (*static_cast<const function<void()>*>(arg))();
+    return nullptr;
+  };
+  ASSERT_EQ(0, pthread_create(&thread, &attr, run, const_cast<function<void()>*>(&fn)));
+  pthread_join(thread, nullptr);
+  pthread_attr_destroy(&attr);
+}
+
+TEST(TemplateRegistry, DepthLimitOfSpecializedPartials) {
+  shared_ptr<MemoryTemplateSource> source = make_shared<MemoryTemplateSource>();
+  source->Add("node", "{{#n}}x{{>node}}{{/n}}");
+  TemplateRegistry registry(source);
+  Document static_context;
+  static_context.Parse<0>("{ \"unused\": 1 }");
+  shared_ptr<CompiledTemplate> specialized = make_shared<CompiledTemplate>();
+  ASSERT_TRUE(Specialize(*registry.Get("node"), static_context, specialized.get()));
+  registry.Add("node", specialized);
+
+  string json;
+  for (int i = 0; i < 1000; ++i) json += "{ \"n\": ";
+  json += "false";
+  for (int i = 0; i < 1000; ++i) json += " }";
+  Document document;
+  document.Parse<0>(json.c_str());
+  // A partial with static frames nests as deep as any other, without using more stack.
+  for (int threshold: { 1000, 1, 1 }) {
+    SetClosureTierThreshold(threshold);
+    stringstream ss;
+    bool rendered = false;
+    RunOnSmallStack(256 << 10, [&]() {
+      rendered = registry.Render("node", document, &ss);
+    });
+    EXPECT_TRUE(rendered);
+    EXPECT_EQ(string(999, 'x'), ss.str());
+  }
+  SetClosureTierThreshold(1000);
+}
+
+TEST(TemplateRegistry, ProfilesRendersThatFail) {
+  shared_ptr<MemoryTemplateSource> source = make_shared<MemoryTemplateSource>();
+  source->Add("loop", "x{{>loop}}");
+  source->Add("node", "{{#n}}y{{>node}}{{/n}}");
+  TemplateRegistry registry(source);
+  Document document;
+  document.Parse<0>("{ \"n\": { } }");
+
+  // Every partial and section that was started is counted, including the one that went
+  // too deep, with what was rendered inside it.
+  SetMaxRenderDepth(10);
+  stringstream ss;
+  RenderStats stats;
+  EXPECT_FALSE(registry.Render("loop", document, &ss, &stats));
+  EXPECT_EQ(string(10, 'x'), ss.str());
+  ASSERT_EQ(1, stats.tags.size());
+  EXPECT_EQ("{{>loop}}", stats.tags[0].tag);
+  EXPECT_EQ(10, stats.tags[0].count);
+  EXPECT_EQ(9 + 8 + 7 + 6 + 5 + 4 + 3 + 2 + 1, stats.tags[0].bytes);
+
+  ss.str("");
+  EXPECT_FALSE(registry.Render("node", document, &ss, &stats));
+  EXPECT_EQ(string(5, 'y'), ss.str());
+  map<string, TagStats> tags;
+  for (const TagStats& tag: stats.tags) tags[tag.tag] = tag;
+  EXPECT_EQ(5, tags["{{#n}}"].count);
+  EXPECT_EQ(5 + 4 + 3 + 2 + 1, tags["{{#n}}"].bytes);
+  EXPECT_EQ(5, tags["{{>node}}"].count);
+  SetMaxRenderDepth(10000);
+}
+
+TEST(TemplateRegistry, ProfilesRenders) {
+  shared_ptr<MemoryTemplateSource> source = make_shared<MemoryTemplateSource>();
+  source->Add("page", "<h1>{{title}}</h1>{{#items}}{{>row}}{{/items}}");
+  source->Add("row", "<li>{{name}}</li>");
+  CompileOptions options;
+  options.max_inline_ops = 0;
+  TemplateRegistry registry(source, false, options);
+  Document document;
+  document.Parse<0>("{ \"title\": \"T\", \"items\": "
+      "[ { \"name\": \"a\" }, { \"name\": \"b\" }, { \"name\": \"c\" } ] }");
+
+  // Once cold, and once with the partial in the closure tier.
+  for (int threshold: { 1000, 1 }) {
+    SetClosureTierThreshold(threshold);
+    stringstream expected;
+    ASSERT_TRUE(registry.Render("page", document, &expected));
+    stringstream ss;
+    RenderStats stats;
+    ASSERT_TRUE(registry.Render("page", document, &ss, &stats));
+    EXPECT_EQ(expected.str(), ss.str());
+    EXPECT_EQ(ss.str().size(), stats.bytes);
+
+    map<string, TagStats> tags;
+    for (const TagStats& tag: stats.tags) tags[tag.template_name + " " + tag.tag] = tag;
+    ASSERT_EQ(4, tags.size());
+    EXPECT_EQ(4, tags["page {{title}}"].offset);
+    EXPECT_EQ(18, tags["page {{#items}}"].offset);
+    EXPECT_EQ(28, tags["page {{>row}}"].offset);
+    EXPECT_EQ(4, tags["row {{name}}"].offset);
+    EXPECT_EQ(1, tags["page {{title}}"].count);
+    EXPECT_EQ(1, tags["page {{title}}"].bytes);
+    EXPECT_EQ(1, tags["page {{#items}}"].count);
+    EXPECT_EQ(30, tags["page {{#items}}"].bytes);
+    EXPECT_GE(tags["page {{#items}}"].nanoseconds, tags["page {{>row}}"].nanoseconds);
+    EXPECT_EQ(3, tags["page {{>row}}"].count);
+    EXPECT_EQ(30, tags["page {{>row}}"].bytes);
+    EXPECT_EQ(3, tags["row {{name}}"].count);
+    EXPECT_EQ(3, tags["row {{name}}"].bytes);
+    EXPECT_EQ(3, tags["row {{name}}"].lookups);
+    EXPECT_EQ(3, tags["row {{name}}"].frames_walked);
+  }
+  SetClosureTierThreshold(1000);
+}
+
+TEST(TemplateRegistry, FoldedStacks) {
+  shared_ptr<MemoryTemplateSource> source = make_shared<MemoryTemplateSource>();
+  source->Add("page", "<h1>{{title}}</h1>{{#items}}{{>row}}{{/items}}");
+  source->Add("row", "<li>{{name}}</li>");
+  CompileOptions options;
+  options.max_inline_ops = 0;
+  TemplateRegistry registry(source, false, options);
+  Document document;
+  document.Parse<0>("{ \"title\": \"T\", \"items\": "
+      "[ { \"name\": \"a\" }, { \"name\": \"b\" }, { \"name\": \"c\" } ] }");
+
+  // Two renders, collected together.
+  vector<StackStats> stacks;
+  for (int i = 0; i < 2; ++i) {
+    stringstream ss;
+    RenderStats stats;
+    ASSERT_TRUE(registry.Render("page", document, &ss, &stats));
+    stacks.insert(stacks.end(), stats.stacks.begin(), stats.stacks.end());
+  }
+  stringstream folded;
+  WriteFoldedStacks(stacks, kWeighByBytes, &folded);
+  EXPECT_EQ("page 18\n"
+            "page;{{#items}};row 54\n"
+            "page;{{#items}};row;{{name}} 6\n"
+            "page;{{title}} 2\n", folded.str());
+
+  folded.str("");
+  WriteFoldedStacks(stacks, kWeighByTime, &folded);
+  EXPECT_NE(string::npos, folded.str().find("page;{{#items}};row;{{name}} "));
+}
+
+TEST(TemplateRegistry, Metrics) {
+  shared_ptr<MemoryTemplateSource> source = make_shared<MemoryTemplateSource>();
+  source->Add("metrics_page", "{{#items}}{{>metrics_row}}{{/items}}");
+  source->Add("metrics_row", "<li>{{.}}</li>");
+  source->Add("metrics_other", "");
+  CompileOptions options;
+  options.max_inline_ops = 0;
+  TemplateRegistry registry(source, false, options);
+  registry.SetMetricsName("metrics");
+  Document document;
+  document.Parse<0>("{ \"items\": [ 1, 2, 3 ] }");
+
+  SetRenderMetrics(true);
+  for (int i = 0; i < 10; ++i) {
+    stringstream ss;
+    EXPECT_TRUE(registry.Render("metrics_page", document, &ss));
+  }
+  stringstream ss;
+  EXPECT_FALSE(registry.Render("metrics_missing", document, &ss));
+  SetRenderMetrics(false);
+  EXPECT_TRUE(registry.Render("metrics_page", document, &ss));
+
+  RenderMetrics metrics = GetRenderMetrics("metrics_page", "metrics");
+  EXPECT_EQ(10, metrics.renders);
+  EXPECT_EQ(0, metrics.errors);
+  EXPECT_EQ(10 * 30, metrics.bytes);
+  EXPECT_LT(0, metrics.p50_nanoseconds);
+  EXPECT_LE(metrics.p50_nanoseconds, metrics.p99_nanoseconds);
+  EXPECT_LE(metrics.p99_nanoseconds, metrics.p999_nanoseconds);
+  EXPECT_LE(metrics.p999_nanoseconds, metrics.nanoseconds);
+  EXPECT_EQ(10, metrics.template_lookups);
+  EXPECT_EQ(1, metrics.template_misses);
+  EXPECT_EQ(0, metrics.partial_lookups);
+  EXPECT_EQ(0, GetRenderMetrics("metrics_page").renders);
+
+  RenderMetrics row = GetRenderMetrics("metrics_row", "metrics");
+  EXPECT_EQ(0, row.renders);
+  EXPECT_EQ(30, row.partial_lookups);
+  EXPECT_EQ(1, row.partial_misses);
+
+  // Templates that don't exist are counted together.
+  EXPECT_EQ(0, GetRenderMetrics("metrics_missing", "metrics").renders);
+  EXPECT_EQ(1, GetRenderMetrics("", "metrics").errors);
+
+  string text = ExportRenderMetrics();
+  EXPECT_NE(string::npos, text.find(
+      "mustache_renders_total{registry=\"metrics\",template=\"metrics_page\"} 10\n"));
+  EXPECT_NE(string::npos, text.find("mustache_render_latency_seconds{"
+      "registry=\"metrics\",template=\"metrics_page\",quantile=\"0.99\"}"));
+  EXPECT_NE(string::npos, text.find("mustache_registry_lookups_total{"
+      "registry=\"metrics\",template=\"metrics_row\",kind=\"partial\"} 30\n"));
+
+  // Past the cap, new templates are counted with the missing ones, and existing ones
+  // carry on.
+  SetRenderMetrics(true, 0);
+  EXPECT_TRUE(registry.Render("metrics_other", document, &ss));
+  EXPECT_TRUE(registry.Render("metrics_page", document, &ss));
+  SetRenderMetrics(false);
+  EXPECT_EQ(0, GetRenderMetrics("metrics_other", "metrics").renders);
+  EXPECT_EQ(2, GetRenderMetrics("", "metrics").renders);
+  EXPECT_EQ(11, GetRenderMetrics("metrics_page", "metrics").renders);
+}
+
+TEST(TemplateRegistry, CapturesSlowRenders) {
+  char root[] = "/tmp/mustache-test-XXXXXX";
+  ASSERT_TRUE(mkdtemp(root) != nullptr);
+  string dir = root;
+  shared_ptr<MemoryTemplateSource> source = make_shared<MemoryTemplateSource>();
+  source->Add("slow", "{{#items}}<li>{{name}}</li>{{/items}}");
+  TemplateRegistry registry(source);
+  Document document;
+  document.Parse<0>("{ \"items\": [ { \"name\": \"a\" }, { \"name\": \"b\" } ] }");
+
+  // Captures need somewhere to go.
+  EXPECT_FALSE(SetSlowRenderCapture(1, ""));
+
+  // Every render is slow, but at most one a second is captured.
+  ASSERT_TRUE(SetSlowRenderCapture(1, dir, 2, 1));
+  for (int i = 0; i < 3; ++i) {
+    stringstream ss;
+    ASSERT_TRUE(registry.Render("slow", document, &ss));
+  }
+  EXPECT_EQ(0, access((dir + "/capture-0.json").c_str(), F_OK));
+  EXPECT_NE(0, access((dir + "/capture-1.json").c_str(), F_OK));
+  unlink((dir + "/capture-0.json").c_str());
+
+  // Without the limit, every slow render is captured, and only the last two are kept.
+  ASSERT_TRUE(SetSlowRenderCapture(1, dir, 2, 0));
+  for (int i = 0; i < 3; ++i) {
+    stringstream ss;
+    ASSERT_TRUE(registry.Render("slow", document, &ss));
+  }
+  // Stopping needs no directory.
+  EXPECT_TRUE(SetSlowRenderCapture(0, ""));
+  stringstream ss;
+  ASSERT_TRUE(registry.Render("slow", document, &ss));
+  EXPECT_EQ(0, access((dir + "/capture-0.json").c_str(), F_OK));
+  EXPECT_EQ(0, access((dir + "/capture-1.json").c_str(), F_OK));
+  EXPECT_NE(0, access((dir + "/capture-2.json").c_str(), F_OK));
+
+  // The third render went back to the start of the ring.
+  ifstream file(dir + "/capture-0.json");
+  string json((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  Document capture;
+  capture.Parse<0>(json.c_str());
+  ASSERT_TRUE(capture.IsObject()) << json;
+  EXPECT_EQ(string("slow"), capture["template"].GetString());
+  char fingerprint[17];
+  snprintf(fingerprint, sizeof(fingerprint), "%016llx",
+      static_cast<unsigned long long>(TemplateFingerprint(*registry.Get("slow"))));
+  EXPECT_EQ(string(fingerprint), capture["fingerprint"].GetString());
+  EXPECT_EQ(ss.str().size(), capture["bytes"].GetInt64());
+
+  // The captured context renders the same.
+  stringstream replayed;
+  ASSERT_TRUE(registry.Render("slow", capture["context"], &replayed));
+  EXPECT_EQ(ss.str(), replayed.str());
+  const Value& tags = capture["stats"]["tags"];
+  ASSERT_TRUE(tags.IsArray());
+  ASSERT_EQ(2, tags.Size());
+
+  for (const char* file: { "/capture-0.json", "/capture-1.json" }) {
+    unlink((dir + file).c_str());
+  }
+  rmdir(root);
+}
+
+TEST(TemplateRegistry, SharesIdenticalTemplates) {
+  // Two tenants with the same page under different names, but different partials.
+  CompileOptions options;
+  options.max_inline_ops = 0;
+  shared_ptr<MemoryTemplateSource> a = make_shared<MemoryTemplateSource>();
+  a->Add("home", "<h1>{{title}}</h1>{{>footer}}");
+  a->Add("footer", "a");
+  shared_ptr<MemoryTemplateSource> b = make_shared<MemoryTemplateSource>();
+  b->Add("index", "<h1>{{title}}</h1>{{>footer}}");
+  b->Add("footer", "b");
+  TemplateRegistry registry_a(a, false, options);
+  TemplateRegistry registry_b(b, false, options);
+
+  InternedTemplateStats before = GetInternedTemplateStats();
+  shared_ptr<const CompiledTemplate> home = registry_a.Get("home");
+  shared_ptr<const CompiledTemplate> index = registry_b.Get("index");
+  ASSERT_TRUE(home != nullptr && index != nullptr);
+  EXPECT_EQ(home->packed.data(), index->packed.data());
+  EXPECT_EQ(1, GetInternedTemplateStats().hits - before.hits);
+
+  // Partials are still looked up in each template's own registry.
+  Document document;
+  document.Parse<0>("{ \"title\": \"t\" }");
+  stringstream ss;
+  ASSERT_TRUE(registry_a.Render("home", document, &ss));
+  ASSERT_TRUE(registry_b.Render("index", document, &ss));
+  EXPECT_EQ("<h1>t</h1>a<h1>t</h1>b", ss.str());
+
+  options.deduplicate = false;
+  TemplateRegistry registry_c(a, false, options);
+  EXPECT_NE(home->packed.data(), registry_c.Get("home")->packed.data());
+}
+
+TEST(TemplateRegistry, CheckForUpdates) {
+  shared_ptr<MemoryTemplateSource> source = make_shared<MemoryTemplateSource>();
+  source->Add("page", "a");
+  TemplateRegistry cached(source);
+  TemplateRegistry checked(source, true);
+  Document document;
+  document.Parse<0>("{ }");
+  stringstream ss;
+  ASSERT_TRUE(cached.Render("page", document, &ss));
+  ASSERT_TRUE(checked.Render("page", document, &ss));
+  source->Add("page", "b");
+  ASSERT_TRUE(cached.Render("page", document, &ss));
+  ASSERT_TRUE(checked.Render("page", document, &ss));
+  EXPECT_EQ("aaab", ss.str());
+}
+
+TEST(TemplateRegistry, FileSource) {
+  TemplateRegistry registry(make_shared<FileTemplateSource>("test-templates/"), true);
+  Document document;
+  document.Parse<0>("{ \"a\": 1 }");
+  stringstream ss;
+  ASSERT_TRUE(registry.Render("partial.tmpl", document, &ss));
+  ASSERT_TRUE(registry.Render("mst-template", document, &ss));
+  EXPECT_FALSE(registry.Render("doesntexist", document, &ss));
+  EXPECT_EQ("Hello 1Hello world", ss.str());
+}
+
+TEST(TemplateRegistry, EmbeddedTemplates) {
+  Document document;
+  document.Parse<0>("{ }");
+  stringstream ss;
+  ASSERT_TRUE(embedded_test_templates()->Render("mst-template", document, &ss));
+  ASSERT_TRUE(embedded_test_templates()->Render("mst-template.mustache", document, &ss));
+  EXPECT_FALSE(embedded_test_templates()->Render("partial.tmpl", document, &ss));
+  EXPECT_EQ("Hello worldHello world", ss.str());
+  // Templates in subdirectories are embedded too, under their relative path.
+  EXPECT_TRUE(embedded_test_templates()->Get("directory/rows/row") != nullptr);
+}
+
+TEST(CompileDirectory, ReportsProblems) {
+  CompileDirectoryReport report;
+  EXPECT_FALSE(CompileDirectory("test-templates/directory/", 4, &report));
+  EXPECT_EQ((vector<string>{ "../partial.tmpl", "a", "b", "bad", "outside", "page",
+      "rows/row", "tree" }), report.templates);
+  EXPECT_EQ(vector<string>{ "bad" }, report.malformed);
+  ASSERT_EQ(1, report.missing_partials.size());
+  EXPECT_EQ(make_pair(string("rows/row"), string("missing")),
+      report.missing_partials[0]);
+  ASSERT_EQ(2, report.cycles.size());
+  EXPECT_EQ((vector<string>{ "tree" }), report.cycles[0]);
+  EXPECT_EQ((vector<string>{ "a", "b" }), report.cycles[1]);
+
+  // 'rows/row' was compiled first, so was inlined, leaving only the missing partial.
+  TemplateRegistry* registry = FileTemplateRegistry("test-templates/directory/");
+  shared_ptr<const CompiledTemplate> page = registry->Get("page");
+  ASSERT_TRUE(page != nullptr);
+  vector<string> partials;
+  for (const TemplateOp& op: page->ops) {
+    if (op.op == PARTIAL) partials.push_back(page->str(op.text));
+  }
+  EXPECT_EQ(vector<string>{ "missing" }, partials);
+  Document document;
+  document.Parse<0>("{ \"title\": \"t\", \"rows\": [1, 2], \"a\": 3 }");
+  stringstream ss;
+  ASSERT_TRUE(registry->Render("page", document, &ss));
+  ASSERT_TRUE(registry->Render("outside", document, &ss));
+  EXPECT_EQ("<h1>t</h1><p>1</p><p>2</p>outside Hello 3", ss.str());
+}
+
+TEST(TemplateRegistry, MappedFiles) {
+  char root[] = "/tmp/mustache-test-XXXXXX";
+  ASSERT_TRUE(mkdtemp(root) != nullptr);
+  string dir = string(root) + "/";
+  string literal(100000, 'x');
+  ofstream(dir + "report.mustache") << literal << "{{a}}" << literal << "{{>row}}";
+  ofstream(dir + "row.mustache") << "<{{a}}>";
+
+  TemplateRegistry copied(make_shared<FileTemplateSource>(dir));
+  TemplateRegistry mapped(make_shared<FileTemplateSource>(dir, 1));
+  shared_ptr<const CompiledTemplate> tmpl = mapped.Get("report");
+  ASSERT_TRUE(tmpl != nullptr);
+  EXPECT_FALSE(tmpl->source.empty());
+  EXPECT_LT(tmpl->pool.size(), 100);
+  EXPECT_GT(copied.Get("report")->pool.size(), 200000);
+
+  Document document;
+  document.Parse<0>("{ \"a\": 1 }");
+  stringstream expected;
+  ASSERT_TRUE(copied.Render("report", document, &expected));
+  stringstream ss;
+  ASSERT_TRUE(mapped.Render("report", document, &ss));
+  EXPECT_EQ(expected.str(), ss.str());
+
+  // Templates written to a bundle carry their own copy of the text.
+  string path = dir + "bundle";
+  ASSERT_TRUE(WriteTemplateBundle(path, { { "report", tmpl } }));
+  TemplateRegistry loaded(make_shared<FileTemplateSource>(dir));
+  ASSERT_TRUE(LoadTemplateBundle(path, &loaded));
+  ss.str("");
+  ASSERT_TRUE(loaded.Render("report", document, &ss));
+  EXPECT_EQ(expected.str(), ss.str());
+
+  for (const char* file: { "report.mustache", "row.mustache", "bundle" }) {
+    unlink((dir + file).c_str());
+  }
+  rmdir(root);
+}
+
+TEST(ReloadingTemplateRegistry, PicksUpChanges) {
+  char root[] = "/tmp/mustache-test-XXXXXX";
+  ASSERT_TRUE(mkdtemp(root) != nullptr);
+  string dir = string(root) + "/";
+  ofstream(dir + "page.mustache") << "<{{>row}}>";
+  ofstream(dir + "row.mustache") << "{{a}}";
+
+  Document document;
+  document.Parse<0>("{ \"a\": 1 }");
+  ReloadingTemplateRegistry registry(dir);
+  stringstream ss;
+  ASSERT_TRUE(registry.Render("page", document, &ss));
+  EXPECT_EQ(1, registry.generation());
+
+  // Changing the partial recompiles the page it was inlined into.
+  ofstream(dir + "row.mustache") << "{{a}}{{a}}";
+  for (int i = 0; i < 500 && registry.generation() == 1; ++i) usleep(10000);
+  ASSERT_EQ(2, registry.generation());
+  ASSERT_TRUE(registry.Render("page", document, &ss));
+  EXPECT_EQ("<1><11>", ss.str());
+
+  unlink((dir + "page.mustache").c_str());
+  unlink((dir + "row.mustache").c_str());
+  for (int i = 0; i < 500 && registry.generation() == 2; ++i) usleep(10000);
+  EXPECT_FALSE(registry.Render("page", document, &ss));
+  rmdir(root);
+}
+
+TEST(ReloadingTemplateRegistry, WatchesPartialsOutsideRoot) {
+  char root[] = "/tmp/mustache-test-XXXXXX";
+  ASSERT_TRUE(mkdtemp(root) != nullptr);
+  string outside = string(root) + "/";
+  string dir = outside + "templates/";
+  ASSERT_EQ(0, mkdir(dir.c_str(), 0700));
+  ofstream(dir + "page.mustache") << "<{{>../shared}}>";
+  ofstream(outside + "shared.mustache") << "a";
+
+  Document document;
+  document.Parse<0>("{ }");
+  ReloadingTemplateRegistry registry(dir);
+  ofstream(outside + "shared.mustache") << "b";
+  for (int i = 0; i < 500 && registry.generation() == 1; ++i) usleep(10000);
+  ASSERT_EQ(2, registry.generation());
+  stringstream ss;
+  ASSERT_TRUE(registry.Render("page", document, &ss));
+  EXPECT_EQ("<b>", ss.str());
+
+  unlink((dir + "page.mustache").c_str());
+  unlink((outside + "shared.mustache").c_str());
+  rmdir(dir.c_str());
+  rmdir(root);
+}
+
+TEST(TemplateBundle, RoundTrip) {
+  shared_ptr<MemoryTemplateSource> source = make_shared<MemoryTemplateSource>();
+  source->Add("page", "<ul>{{#nodes}}{{>node}}{{/nodes}}</ul>");
+  source->Add("node", "<li>{{name}}{{#children}}{{>node}}{{/children}}</li>");
+  TemplateRegistry registry(source);
+  map<string, shared_ptr<const CompiledTemplate> > templates;
+  templates["page"] = registry.Get("page");
+  templates["node"] = registry.Get("node");
+  char path_template[] = "/tmp/mustache-test-XXXXXX";
+  int fd = mkstemp(path_template);
+  ASSERT_NE(-1, fd);
+  close(fd);
+  string path = path_template;
+  ASSERT_TRUE(WriteTemplateBundle(path, templates));
+
+  // Nothing is read from the source of the loaded registry.
+  TemplateRegistry loaded(make_shared<MemoryTemplateSource>());
+  ASSERT_TRUE(LoadTemplateBundle(path, &loaded));
+  Document document;
+  document.Parse<0>("{ \"nodes\": [ { \"name\": \"a\", \"children\": "
+      "[ { \"name\": \"b\", \"children\": [] } ] } ] }");
+  stringstream ss;
+  ASSERT_TRUE(loaded.Render("page", document, &ss));
+  EXPECT_EQ("<ul><li>a<li>b</li></li></ul>", ss.str());
+
+  // Truncated bundles are rejected.
+  ASSERT_EQ(0, truncate(path.c_str(), 40));
+  TemplateRegistry truncated(make_shared<MemoryTemplateSource>());
+  EXPECT_FALSE(LoadTemplateBundle(path, &truncated));
+  remove(path.c_str());
+}
+
 TEST(Errors, BasicErrors) {
   TestTemplateExpectError("{{?b}}{{/a}}", "{ }");
 }
 
+TEST(Errors, UnterminatedTags) {
+  // A stray '}' inside a tag that never closes is part of the tag name.
+  TestTemplate("x{{a}", "{ \"a\": 1 }", "x");
+  TestTemplate("x{{{a}} y", "{ \"a\": 1 }", "x");
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
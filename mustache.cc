@@ -11,15 +11,40 @@
 // limitations under the License.
 
 #include "mustache.h"
+#include "mustache-internal.h"
 
 #include "rapidjson/stringbuffer.h"
 #include <rapidjson/prettywriter.h>
 #include "rapidjson/writer.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <fstream>
+#include <list>
+#include <map>
+#include <set>
 #include <vector>
 #include <stack>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <boost/algorithm/string.hpp>
 
@@ -27,37 +52,58 @@ using namespace rapidjson;
 using namespace std;
 using namespace boost::algorithm;
 
+// Static tracepoints at the start and end of renders, on entering and leaving sections,
+// on loading partials and on cache misses. With MUSTACHE_USDT defined, they are USDT
+// probes of the "mustache" provider, through systemtap's <sys/sdt.h>: each is a single
+// nop until a tracer such as bpftrace attaches to it. Otherwise they compile to nothing:
+// their arguments are named in sizeof, so they count as used but aren't evaluated.
+#ifdef MUSTACHE_USDT
+#include <sys/sdt.h>
+#define MUSTACHE_PROBE1(name, a) STAP_PROBE1(mustache, name, a)
+#define MUSTACHE_PROBE2(name, a, b) STAP_PROBE2(mustache, name, a, b)
+#define MUSTACHE_PROBE3(name, a, b, c) STAP_PROBE3(mustache, name, a, b, c)
+#else
+#define MUSTACHE_PROBE1(name, a) do { (void)sizeof(a); } while (0)
+#define MUSTACHE_PROBE2(name, a, b) do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define MUSTACHE_PROBE3(name, a, b, c) \
+    do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
+
 namespace mustache {
 
 // TODO:
 // # Handle malformed templates better
-// # Better support for reading templates from files
-
-enum TagOperator {
-  SUBSTITUTION,
-  SECTION_START,
-  NEGATED_SECTION_START,
-  PREDICATE_SECTION_START,
-  SECTION_END,
-  PARTIAL,
-  COMMENT,
-  LENGTH,
-  EQUALITY,
-  INEQUALITY,
-  LITERAL,
-  NONE
-};
 
-struct OpCtx {
+// An op of a template that is being compiled. The compiler passes (inlining, slot
+// optimization and specialization) work on these, before they are packed into a
+// CompiledTemplate. Fields are as in TemplateOp.
+struct OpBuilder {
   TagOperator op;
-  string tag_name;
-  string tag_arg;
+  string text;
+  string arg;
   bool escaped = false;
+  int end = -1;
+  int slot = -1;
+  int slots_begin = 0;
+  int slots_end = 0;
+
+  // For TEXT ops, the offset of 'text' in the template's source text if it appears there
+  // verbatim, or -1.
+  int64_t source = -1;
+
+  // The offset in the template's source text of the tag that the op was compiled from, or
+  // of the partial tag it was inlined through, or -1 if there is none.
+  int64_t offset = -1;
+};
+
+struct SlotBuilder {
+  vector<string> components;
+  int parent = -1;
 };
 
-struct ContextStack {
-  const Value* value;
-  const ContextStack* parent;
+struct TemplateBuilder {
+  vector<OpBuilder> ops;
+  vector<SlotBuilder> slots;
 };
 
 TagOperator GetOperator(const string& tag) {
@@ -78,29 +124,36 @@ TagOperator GetOperator(const string& tag) {
   }
 }
 
-int EvaluateTag(const string& document, const string& document_root, int idx,
-    const ContextStack* context, const OpCtx& op_ctx, stringstream* out);
+struct RenderState;
 
-static bool RenderTemplate(const string& document, const string& document_root,
-                           const ContextStack* stack, stringstream* out);
+static bool RenderTemplate(const CompiledTemplate& tmpl, const ContextStack* stack,
+                           stringstream* out);
 
-void EscapeHtml(const string& in, stringstream *out) {
-  for (const char& c: in) {
-    switch (c) {
-      case '&': (*out) << "&amp;";
+// Writes the 'length' characters at 'in' to 'out', escaping HTML special characters. Runs
+// of characters that need no escaping are written in one go.
+void EscapeHtml(const char* in, size_t length, stringstream *out) {
+  size_t start = 0;
+  for (size_t i = 0; i < length; ++i) {
+    const char* escaped;
+    switch (in[i]) {
+      case '&': escaped = "&amp;";
         break;
-      case '"': (*out) << "&quot;";
+      case '"': escaped = "&quot;";
         break;
-      case '\'': (*out) << "&apos;";
+      case '\'': escaped = "&apos;";
         break;
-      case '<': (*out) << "&lt;";
+      case '<': escaped = "&lt;";
         break;
-      case '>': (*out) << "&gt;";
-        break;
-      default: (*out) << c;
+      case '>': escaped = "&gt;";
         break;
+      default:
+        continue;
     }
+    out->write(in + start, i - start);
+    (*out) << escaped;
+    start = i + 1;
   }
+  out->write(in + start, length - start);
 }
 
 void Dump(const rapidjson::Value& v) {
@@ -110,6 +163,16 @@ void Dump(const rapidjson::Value& v) {
   std::cout << buffer.GetString() << std::endl;
 }
 
+// Returns the 64-bit FNV-1a hash of 'size' bytes at 'data', continuing from 'hash'.
+uint64_t HashBytes(const char* data, size_t size,
+    uint64_t hash = 14695981039346656037ULL) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
 // Breaks a dotted path into individual components. One wrinkle, which stops this from
 // being a simple split() is that we allow path components to be quoted, e.g.: "foo".bar,
 // and any '.' characters inside those quoted sections aren't considered to be
@@ -149,10 +212,38 @@ void FindJsonPathComponents(const string& path, vector<string>* components) {
   }
 }
 
+// Looks up the path made of 'components' in 'value' alone, without consulting any
+// enclosing context. Returns nullptr if the path does not exist.
+const Value* ResolveJsonPath(const vector<string>& components, const Value* value) {
+  for(const string& c: components) {
+    if (value->IsObject() && value->HasMember(c.c_str())) {
+      value = &(*value)[c.c_str()];
+    } else {
+      return nullptr;
+    }
+  }
+  return value;
+}
+
+// As above, for the 'num_components' path components of 'tmpl' at 'components'.
+const Value* ResolveJsonPath(const CompiledTemplate& tmpl, const uint32_t* components,
+    int num_components, const Value* value) {
+  for (int i = 0; i < num_components; ++i) {
+    const char* c = tmpl.str(components[i]);
+    if (value->IsObject() && value->HasMember(c)) {
+      value = &(*value)[c];
+    } else {
+      return nullptr;
+    }
+  }
+  return value;
+}
+
 // Looks up the json entity at 'path' in 'parent_context', and places it in 'resolved'. If
 // the entity does not exist (i.e. the path is invalid), 'resolved' will be set to nullptr.
+// Adds the number of levels of context searched to 'frames_walked'.
 void ResolveJsonContext(const string& path, const ContextStack* stack,
-    const Value** resolved) {
+    const Value** resolved, int64_t* frames_walked) {
   if (path == ".") {
     *resolved = stack->value;
     return;
@@ -162,28 +253,23 @@ void ResolveJsonContext(const string& path, const ContextStack* stack,
 
   // At each enclosing level of context, try to resolve the path.
   for ( ; stack != nullptr; stack = stack->parent) {
-    const Value* cur = stack->value;
-    bool match = true;
-    for(const string& c: components) {
-      if (cur->IsObject() && cur->HasMember(c.c_str())) {
-        cur = &(*cur)[c.c_str()];
-      } else {
-        match = false;
-        break;
-      }
-    }
-    if (match) {
-      *resolved = cur;
-      return;
-    }
+    ++*frames_walked;
+    *resolved = ResolveJsonPath(components, stack->value);
+    if (*resolved != nullptr) return;
   }
-  *resolved = nullptr;
 }
 
-int FindNextTag(const string& document, int idx, OpCtx* op, stringstream* out) {
+void ResolveJsonContext(const string& path, const ContextStack* stack,
+    const Value** resolved) {
+  int64_t frames_walked = 0;
+  ResolveJsonContext(path, stack, resolved, &frames_walked);
+}
+
+int FindNextTag(const ArrayView<char>& document, int idx, OpCtx* op, stringstream* out) {
   op->op = NONE;
   while (idx < document.size()) {
     if (document[idx] == '{' && idx < (document.size() - 3) && document[idx + 1] == '{') {
+      op->offset = idx;
       if (document[idx + 2] == '{') {
         idx += 3;
         op->escaped = true;
@@ -206,6 +292,7 @@ int FindNextTag(const string& document, int idx, OpCtx* op, stringstream* out) {
             break;
           } else {
             expr << '}';
+            ++idx;
           }
         }
       }
@@ -241,93 +328,591 @@ int FindNextTag(const string& document, int idx, OpCtx* op, stringstream* out) {
   return idx;
 }
 
-// Evaluates a [PREDICATE_|NEGATED_]SECTION_START / SECTION_END pair by evaluating the tag
-// in 'parent_context'. False or non-existant values cause the entire section to be
-// skipped. True values cause the section to be evaluated as though it were a normal
-// section, but with the parent context being the root context for that section.
-//
-// If 'is_negation' is true, the behaviour is the opposite of the above: false values
-// cause the section to be normally evaluated etc.
-int EvaluateSection(const string& document, const string& document_root, int idx,
-    const ContextStack* context_stack, const OpCtx& op_ctx, stringstream* out) {
-  // Precondition: idx is the immediate next character after an opening {{ #tag_name }}
-  const Value* context;
-  ResolveJsonContext(op_ctx.tag_name, context_stack, &context);
-
-  // If we a) cannot resolve the context from the tag name or b) the context evaluates to
-  // false, we should skip the contents of the template until a closing {{/tag_name}}.
-  bool skip_contents = false;
-
-  if (op_ctx.op == NEGATED_SECTION_START || op_ctx.op == PREDICATE_SECTION_START ||
-      op_ctx.op == SECTION_START) {
-    skip_contents = (context == nullptr || context->IsFalse());
 
-    // If the tag is a negative block (i.e. {{^tag_name}}), do the opposite: if the
-    // context exists and is true, skip the contents, else echo them.
-    if (op_ctx.op == NEGATED_SECTION_START) {
-      context = context_stack->value;
-      skip_contents = !skip_contents;
-    } else if (op_ctx.op == PREDICATE_SECTION_START) {
-      context = context_stack->value;
+// Appends 'text', found at offset 'source' in the source text (or -1), to 'ops' as a
+// TEXT op, merging it with the previous op if that was also literal text. Text in the
+// source is only merged with text that follows it there, so that it needn't be copied.
+void AppendText(const string& text, vector<OpBuilder>* ops, int64_t source = -1) {
+  if (text.empty()) return;
+  if (!ops->empty() && ops->back().op == TEXT) {
+    OpBuilder& back = ops->back();
+    if (back.source == -1 && source == -1) {
+      back.text += text;
+      return;
+    }
+    if (back.source != -1 && source == back.source + back.text.size()) {
+      back.text += text;
+      return;
     }
-  } else if (op_ctx.op == INEQUALITY || op_ctx.op == EQUALITY) {
-    skip_contents = (context == nullptr || !context->IsString() ||
-        strcasecmp(context->GetString(), op_ctx.tag_arg.c_str()) != 0);
-    if (op_ctx.op == INEQUALITY) skip_contents = !skip_contents;
-    context = context_stack->value;
   }
+  OpBuilder op;
+  op.op = TEXT;
+  op.text = text;
+  op.source = source;
+  ops->push_back(op);
+}
+
+void OptimizeTemplate(TemplateBuilder* tmpl);
+
+// The packed form of a template starts with this header, followed by the ops, the slots,
+// the path components, the source offset of each op, the opcode of each op and finally
+// the string pool.
+struct PackedTemplateHeader {
+  uint32_t num_ops;
+  uint32_t num_slots;
+  uint32_t num_components;
+  uint32_t pool_size;
+};
+
+shared_ptr<TemplateTier> NewTemplateTier();
 
-  vector<const Value*> values;
-  if (!skip_contents && context != nullptr && context->IsArray()) {
-    for (int i = 0; i < context->Size(); ++i) {
-      values.push_back(&(*context)[i]);
+// Points the views of 'tmpl' into the packed template of 'size' bytes at 'packed', which
+// must be 4-byte aligned. If 'verify' is true, checks that every offset and index in it is
+// in range first, and returns false if not.
+bool AttachPackedTemplate(const char* packed, size_t size, bool verify,
+    CompiledTemplate* tmpl) {
+  if (size < sizeof(PackedTemplateHeader)) return false;
+  const PackedTemplateHeader* header =
+      reinterpret_cast<const PackedTemplateHeader*>(packed);
+  uint64_t expected_size = sizeof(PackedTemplateHeader) +
+      static_cast<uint64_t>(header->num_ops) * sizeof(TemplateOp) +
+      static_cast<uint64_t>(header->num_slots) * sizeof(PathSlot) +
+      static_cast<uint64_t>(header->num_components) * sizeof(uint32_t) +
+      static_cast<uint64_t>(header->num_ops) * (sizeof(uint32_t) + 1) +
+      header->pool_size;
+  if (size != expected_size) return false;
+
+  const char* cur = packed + sizeof(PackedTemplateHeader);
+  tmpl->ops = ArrayView<TemplateOp>(reinterpret_cast<const TemplateOp*>(cur),
+      header->num_ops);
+  cur += header->num_ops * sizeof(TemplateOp);
+  tmpl->slots = ArrayView<PathSlot>(reinterpret_cast<const PathSlot*>(cur),
+      header->num_slots);
+  cur += header->num_slots * sizeof(PathSlot);
+  tmpl->components = ArrayView<uint32_t>(reinterpret_cast<const uint32_t*>(cur),
+      header->num_components);
+  cur += header->num_components * sizeof(uint32_t);
+  tmpl->offsets = ArrayView<uint32_t>(reinterpret_cast<const uint32_t*>(cur),
+      header->num_ops);
+  cur += header->num_ops * sizeof(uint32_t);
+  tmpl->opcodes = ArrayView<uint8_t>(reinterpret_cast<const uint8_t*>(cur),
+      header->num_ops);
+  cur += header->num_ops;
+  tmpl->pool = ArrayView<char>(cur, header->pool_size);
+  tmpl->packed = ArrayView<char>(packed, size);
+  tmpl->tier = NewTemplateTier();
+  if (!verify) return true;
+
+  // Every string must be NUL-terminated inside the pool, which is guaranteed if the pool
+  // ends with a NUL.
+  const int num_ops = tmpl->ops.size();
+  const int num_slots = tmpl->slots.size();
+  if (tmpl->pool.empty() || tmpl->pool[tmpl->pool.size() - 1] != '\0') return num_ops == 0;
+  for (int pc = 0; pc < num_ops; ++pc) {
+    const TemplateOp& op = tmpl->ops[pc];
+    if (op.op >= NONE || tmpl->opcodes[pc] != op.op || op.arg >= tmpl->pool.size() ||
+        op.text + static_cast<uint64_t>(op.text_length) >= tmpl->pool.size() ||
+        op.in_source != 0 || op.slot < -1 || op.slot >= num_slots ||
+        op.slots_begin < 0 || op.slots_begin > op.slots_end || op.slots_end > num_slots) {
+      return false;
     }
-  } else {
-    values.push_back(skip_contents ? nullptr : context);
-  }
-  if (values.size() == 0) {
-    skip_contents = true;
-    values.push_back(nullptr);
-  }
-
-  int start_idx = idx;
-  for(const Value* v: values) {
-    idx = start_idx;
-    stack<OpCtx> section_starts;
-    section_starts.push(op_ctx);
-    while (idx < document.size()) {
-      OpCtx next_ctx;
-      idx = FindNextTag(document, idx, &next_ctx, skip_contents ? nullptr : out);
-      if (skip_contents && (next_ctx.op == SECTION_START ||
-              next_ctx.op == PREDICATE_SECTION_START ||
-              next_ctx.op == NEGATED_SECTION_START)) {
-        section_starts.push(next_ctx);
-      } else if (next_ctx.op == SECTION_END) {
-        if (next_ctx.tag_name != section_starts.top().tag_name) return -1;
-        section_starts.pop();
+    if (op.op == SECTION_END) {
+      if (op.end < 0 || op.end >= pc || tmpl->ops[op.end].end != pc) return false;
+    } else if (op.end != -1) {
+      if (op.end <= pc || op.end >= num_ops || tmpl->ops[op.end].op != SECTION_END) {
+        return false;
       }
-      if (section_starts.empty()) break;
+    } else if (op.op == SECTION_START || op.op == PREDICATE_SECTION_START ||
+        op.op == NEGATED_SECTION_START || op.op == EQUALITY || op.op == INEQUALITY) {
+      return false;
+    }
+  }
+  for (int i = 0; i < num_slots; ++i) {
+    const PathSlot& slot = tmpl->slots[i];
+    if (slot.parent < -1 || slot.parent >= i ||
+        slot.components + static_cast<uint64_t>(slot.num_components) >
+        tmpl->components.size()) {
+      return false;
+    }
+  }
+  for (uint32_t component: tmpl->components) {
+    if (component >= tmpl->pool.size()) return false;
+  }
+  return true;
+}
+
+// Lays out the strings in 'offsets' in a pool, each followed by a NUL, and sets their
+// offsets. A string that is a suffix of another, such as the last component of a path or
+// the empty string, points into the longer one instead of being stored again.
+string LayOutPool(map<string, uint32_t>* offsets) {
+  vector<string> reversed;
+  reversed.reserve(offsets->size());
+  for (const auto& entry: *offsets) {
+    reversed.emplace_back(entry.first.rbegin(), entry.first.rend());
+  }
+  // In descending order, each string that is a suffix of others comes right after one of
+  // them.
+  sort(reversed.begin(), reversed.end(), greater<string>());
+  string pool;
+  const string* previous = nullptr;
+  uint32_t previous_end = 0;
+  for (const string& str: reversed) {
+    uint32_t offset;
+    if (previous != nullptr && starts_with(*previous, str)) {
+      offset = previous_end - str.size();
+    } else {
+      offset = pool.size();
+      pool.append(str.rbegin(), str.rend());
+      pool.push_back('\0');
+      previous = &str;
+      previous_end = pool.size() - 1;
+    }
+    (*offsets)[string(str.rbegin(), str.rend())] = offset;
+  }
+  return pool;
+}
+
+// Packs 'builder' into 'tmpl'. If tmpl->source is set, literal text that appears there
+// verbatim is referred to rather than copied into the pool.
+void PackTemplate(const TemplateBuilder& builder, CompiledTemplate* tmpl) {
+  auto in_source = [&](const OpBuilder& op) {
+    return op.op == TEXT && op.source != -1 && !tmpl->source.empty();
+  };
+  map<string, uint32_t> pool_offsets;
+  for (const OpBuilder& op: builder.ops) {
+    if (!in_source(op)) pool_offsets[op.text];
+    pool_offsets[op.arg];
+  }
+  for (const SlotBuilder& slot: builder.slots) {
+    for (const string& c: slot.components) pool_offsets[c];
+  }
+  string pool = LayOutPool(&pool_offsets);
+
+  vector<TemplateOp> ops;
+  ops.reserve(builder.ops.size());
+  vector<uint32_t> offsets;
+  string opcodes;
+  for (const OpBuilder& op: builder.ops) {
+    offsets.push_back(op.offset == -1 ? kNoOffset : op.offset);
+    opcodes.push_back(op.op);
+    TemplateOp packed;
+    packed.op = op.op;
+    packed.escaped = op.escaped;
+    packed.in_source = in_source(op);
+    packed.unused = 0;
+    packed.text = packed.in_source ? op.source : pool_offsets[op.text];
+    packed.text_length = op.text.size();
+    packed.arg = pool_offsets[op.arg];
+    packed.end = op.end;
+    packed.slot = op.slot;
+    packed.slots_begin = op.slots_begin;
+    packed.slots_end = op.slots_end;
+    ops.push_back(packed);
+  }
+  vector<PathSlot> slots;
+  vector<uint32_t> components;
+  for (const SlotBuilder& slot: builder.slots) {
+    slots.push_back({ static_cast<uint32_t>(components.size()),
+        static_cast<uint32_t>(slot.components.size()), slot.parent });
+    for (const string& c: slot.components) components.push_back(pool_offsets[c]);
+  }
+
+  PackedTemplateHeader header = { static_cast<uint32_t>(ops.size()),
+      static_cast<uint32_t>(slots.size()), static_cast<uint32_t>(components.size()),
+      static_cast<uint32_t>(pool.size()) };
+  shared_ptr<string> packed = make_shared<string>();
+  packed->reserve(sizeof(header) + ops.size() * sizeof(TemplateOp) +
+      slots.size() * sizeof(PathSlot) + components.size() * sizeof(uint32_t) +
+      offsets.size() * sizeof(uint32_t) + opcodes.size() + pool.size());
+  packed->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  packed->append(reinterpret_cast<const char*>(ops.data()),
+      ops.size() * sizeof(TemplateOp));
+  packed->append(reinterpret_cast<const char*>(slots.data()),
+      slots.size() * sizeof(PathSlot));
+  packed->append(reinterpret_cast<const char*>(components.data()),
+      components.size() * sizeof(uint32_t));
+  packed->append(reinterpret_cast<const char*>(offsets.data()),
+      offsets.size() * sizeof(uint32_t));
+  packed->append(opcodes);
+  packed->append(pool);
+  AttachPackedTemplate(packed->data(), packed->size(), false, tmpl);
+  tmpl->storage = packed;
+}
+
+// Unpacks the ops and slots of 'tmpl' into 'builder', so that they can be transformed.
+void UnpackTemplate(const CompiledTemplate& tmpl, TemplateBuilder* builder) {
+  builder->ops.clear();
+  for (int pc = 0; pc < tmpl.ops.size(); ++pc) {
+    const TemplateOp& packed = tmpl.ops[pc];
+    OpBuilder op;
+    op.op = static_cast<TagOperator>(packed.op);
+    op.text.assign(tmpl.text(packed), packed.text_length);
+    if (packed.in_source) op.source = packed.text;
+    op.arg = tmpl.str(packed.arg);
+    op.escaped = packed.escaped;
+    op.end = packed.end;
+    op.slot = packed.slot;
+    op.slots_begin = packed.slots_begin;
+    op.slots_end = packed.slots_end;
+    if (tmpl.offsets[pc] != kNoOffset) op.offset = tmpl.offsets[pc];
+    builder->ops.push_back(op);
+  }
+  builder->slots.clear();
+  for (const PathSlot& packed: tmpl.slots) {
+    SlotBuilder slot;
+    for (int i = 0; i < packed.num_components; ++i) {
+      slot.components.push_back(tmpl.str(tmpl.components[packed.components + i]));
+    }
+    slot.parent = packed.parent;
+    builder->slots.push_back(slot);
+  }
+}
+
+// The templates that are being compiled by a registry on this thread, innermost last.
+// Used to stop recursive partials from being inlined into themselves.
+static thread_local vector<pair<const TemplateRegistry*, string> > templates_being_compiled;
+
+// Replaces PARTIAL ops with the ops of the partial they name, if it is small enough.
+void InlinePartials(TemplateRegistry* registry, const CompileOptions& options,
+    TemplateBuilder* tmpl) {
+  vector<OpBuilder> ops;
+  ops.reserve(tmpl->ops.size());
+  vector<int> section_starts;
+  // Appends 'op', linking it to the start of its section if it ends one.
+  auto append = [&](const OpBuilder& op) {
+    if (op.op == TEXT) {
+      AppendText(op.text, &ops, op.source);
+      return;
+    }
+    ops.push_back(op);
+    if (op.op == SECTION_END) {
+      ops.back().end = section_starts.back();
+      ops[section_starts.back()].end = ops.size() - 1;
+      section_starts.pop_back();
+    } else if (op.end != -1) {
+      section_starts.push_back(ops.size() - 1);
+    }
+  };
 
-      // Don't need to evaluate any templates if we're skipping the contents
-      if (!skip_contents) {
-        ContextStack new_context = { v, context_stack };
-        idx = EvaluateTag(document, document_root, idx, &new_context, next_ctx, out);
+  for (const OpBuilder& op: tmpl->ops) {
+    pair<const TemplateRegistry*, string> partial_name(registry, op.text);
+    if (op.op == PARTIAL &&
+        find(templates_being_compiled.begin(), templates_being_compiled.end(),
+            partial_name) == templates_being_compiled.end()) {
+      shared_ptr<const CompiledTemplate> partial = registry->Get(op.text);
+      if (partial != nullptr && partial->ops.size() <= options.max_inline_ops) {
+        TemplateBuilder partial_builder;
+        UnpackTemplate(*partial, &partial_builder);
+        for (OpBuilder& partial_op: partial_builder.ops) {
+          // Slots belong to the partial; the optimizer assigns new ones.
+          partial_op.slot = -1;
+          partial_op.slots_begin = partial_op.slots_end = 0;
+          // As does any source text, and the tags are reported at the partial tag.
+          partial_op.source = -1;
+          partial_op.offset = op.offset;
+          append(partial_op);
+        }
+        continue;
       }
     }
+    append(op);
   }
-  return idx;
+  tmpl->ops.swap(ops);
+}
+
+// Compiles 'document' into 'tmpl'. If 'source' is set, it holds 'document', and literal
+// text is referred to in place.
+bool CompileText(const ArrayView<char>& document, const string& document_root,
+    const TemplateText* source, CompiledTemplate* tmpl, const CompileOptions& options) {
+  TemplateBuilder builder;
+  vector<OpBuilder>& ops = builder.ops;
+  TemplateRegistry* registry = options.registry != nullptr ?
+      options.registry : FileTemplateRegistry(document_root, options.check_for_updates);
+
+  // Indices of the ops that opened each currently enclosing section.
+  vector<int> section_starts;
+  int idx = 0;
+  while (idx < document.size()) {
+    OpCtx op_ctx;
+    stringstream text;
+    int text_start = idx;
+    idx = FindNextTag(document, idx, &op_ctx, &text);
+    // The text is usually a verbatim copy of the document up to the tag, but not always,
+    // e.g. empty tags are dropped from it.
+    string literal = text.str();
+    bool verbatim = source != nullptr &&
+        literal.compare(0, literal.size(), document.data() + text_start,
+            min<size_t>(literal.size(), document.size() - text_start)) == 0;
+    AppendText(literal, &ops, verbatim ? text_start : -1);
+
+    OpBuilder op;
+    op.op = op_ctx.op;
+    op.text = op_ctx.tag_name;
+    op.arg = op_ctx.tag_arg;
+    op.escaped = op_ctx.escaped;
+    op.offset = op_ctx.offset;
+    switch (op_ctx.op) {
+      case NONE:
+      case COMMENT:
+        break;
+      case SECTION_START:
+      case PREDICATE_SECTION_START:
+      case NEGATED_SECTION_START:
+      case EQUALITY:
+      case INEQUALITY:
+        section_starts.push_back(ops.size());
+        ops.push_back(op);
+        break;
+      case SECTION_END:
+        // Closing tags with no open section are ignored.
+        if (section_starts.empty()) break;
+        if (ops[section_starts.back()].text != op.text) return false;
+        op.end = section_starts.back();
+        ops[op.end].end = ops.size();
+        ops.push_back(op);
+        section_starts.pop_back();
+        break;
+      default:
+        ops.push_back(op);
+        break;
+    }
+  }
+
+  // Sections that are still open run to the end of the document.
+  while (!section_starts.empty()) {
+    OpBuilder op;
+    op.op = SECTION_END;
+    op.text = ops[section_starts.back()].text;
+    op.end = section_starts.back();
+    ops[op.end].end = ops.size();
+    ops.push_back(op);
+    section_starts.pop_back();
+  }
+
+  if (options.max_inline_ops > 0 && !registry->check_for_updates()) {
+    InlinePartials(registry, options, &builder);
+  }
+  if (options.optimize) OptimizeTemplate(&builder);
+  if (source != nullptr) {
+    tmpl->source = source->text;
+    tmpl->source_storage = source->storage;
+  } else {
+    tmpl->source = ArrayView<char>();
+    tmpl->source_storage.reset();
+  }
+  PackTemplate(builder, tmpl);
+  tmpl->registry = registry;
+  tmpl->static_frames.clear();
+  return true;
+}
+
+bool CompileTemplate(const string& document, const string& document_root,
+    CompiledTemplate* tmpl, const CompileOptions& options) {
+  return CompileText(ArrayView<char>(document.data(), document.size()), document_root,
+      nullptr, tmpl, options);
+}
+
+bool CompileTemplate(const TemplateText& document, const string& document_root,
+    CompiledTemplate* tmpl, const CompileOptions& options) {
+  return CompileText(document.text, document_root,
+      document.storage != nullptr ? &document : nullptr, tmpl, options);
+}
+
+// Placeholder for path slots that have not been resolved yet during the current entry
+// into their scope.
+static const Value kUnresolved;
+
+int64_t NowNanoseconds() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The running totals of a profiled render, as they were when an op started.
+struct ProfileSample {
+  int64_t nanoseconds;
+  int64_t bytes;
+  int64_t lookups;
+  int64_t frames_walked;
+};
+
+// A node of the call tree of a profiled render: op 'op' of 'tmpl', as run from within
+// node 'parent'. The root is the template being rendered, with an 'op' of -1.
+struct StackNode {
+  int parent;
+  const CompiledTemplate* tmpl;
+  int op;
+
+  // Spent in the op, including in the nodes below it.
+  int64_t nanoseconds;
+  int64_t bytes;
+};
+
+// What a profiled render has found so far (see RenderStats). Ops are counted both by
+// the template they are in and their index there, and by where they were run from.
+struct RenderProfile {
+  RenderProfile(stringstream* out, const CompiledTemplate* tmpl) : out(out) {
+    nodes.push_back({ -1, tmpl, -1, 0, 0 });
+    path.push_back(0);
+  }
+
+  // Returns the totals so far.
+  ProfileSample Sample() const {
+    return { NowNanoseconds(), static_cast<int64_t>(out->tellp()), lookups,
+        frames_walked };
+  }
+
+  // Enters op 'op' of 'tmpl', below the op that is running. Returns the totals to charge
+  // the op from when it stops.
+  ProfileSample Start(const CompiledTemplate* tmpl, int op) {
+    auto child = children.emplace(make_tuple(path.back(), tmpl, op), nodes.size());
+    if (child.second) nodes.push_back({ path.back(), tmpl, op, 0, 0 });
+    path.push_back(child.first->second);
+    return Sample();
+  }
+
+  // Charges what happened since 'start' to op 'op' of 'tmpl', and leaves it.
+  void Stop(const CompiledTemplate* tmpl, int op, const ProfileSample& start) {
+    ProfileSample now = Sample();
+    TagStats& stats = ops[make_pair(tmpl, op)];
+    ++stats.count;
+    stats.nanoseconds += now.nanoseconds - start.nanoseconds;
+    stats.bytes += now.bytes - start.bytes;
+    stats.lookups += now.lookups - start.lookups;
+    stats.frames_walked += now.frames_walked - start.frames_walked;
+    StackNode& node = nodes[path.back()];
+    node.nanoseconds += now.nanoseconds - start.nanoseconds;
+    node.bytes += now.bytes - start.bytes;
+    path.pop_back();
+  }
+
+  // Records that 'tmpl' is rendered as 'name', and keeps it alive until the profile has
+  // been reported.
+  void AddTemplate(shared_ptr<const CompiledTemplate> tmpl, const string& name) {
+    if (templates.count(tmpl.get()) == 0) templates[tmpl.get()] = make_pair(name, tmpl);
+  }
+
+  stringstream* out;
+
+  // Lookups made and context frames they searched, by all ops so far.
+  int64_t lookups = 0;
+  int64_t frames_walked = 0;
+
+  map<pair<const CompiledTemplate*, int>, TagStats> ops;
+  map<const CompiledTemplate*, pair<string, shared_ptr<const CompiledTemplate> > >
+      templates;
+
+  // The call tree, and the nodes of the ops that are running, innermost last.
+  vector<StackNode> nodes;
+  map<tuple<int, const CompiledTemplate*, int>, int> children;
+  vector<int> path;
+};
+
+// The state of a single render of a compiled template.
+struct RenderState {
+  const CompiledTemplate* tmpl;
+
+  // The resolved value of each of tmpl->slots, or &kUnresolved.
+  vector<const Value*> slots;
+
+  stringstream* out;
+
+  // The DispatchMode used for this render.
+  int dispatch;
+
+  // Set if the render was abandoned, because it nested too deeply.
+  bool failed = false;
+
+  // Set if the render is profiled.
+  RenderProfile* profile = nullptr;
+};
+
+// Resolves path slot 'slot' in 'stack', which must be the context stack of the scope that
+// the slot belongs to. A slot in a section only needs to look at the frame pushed by that
+// section: if the path isn't found there, the result is the same as that of the enclosing
+// scope, which is cached for as long as the section runs. With kProfiled, lookups are
+// counted in state->profile.
+template <bool kProfiled = false>
+const Value* ResolveSlot(RenderState* state, int slot, const ContextStack* stack) {
+  if (state->slots[slot] != &kUnresolved) return state->slots[slot];
+  const CompiledTemplate& tmpl = *state->tmpl;
+  const PathSlot& path_slot = tmpl.slots[slot];
+  const uint32_t* components = tmpl.components.data() + path_slot.components;
+  const Value* resolved = nullptr;
+  if (kProfiled) ++state->profile->lookups;
+  if (path_slot.parent == -1) {
+    for ( ; stack != nullptr && resolved == nullptr; stack = stack->parent) {
+      if (kProfiled) ++state->profile->frames_walked;
+      resolved = ResolveJsonPath(tmpl, components, path_slot.num_components, stack->value);
+    }
+  } else if (stack != nullptr) {
+    if (kProfiled) ++state->profile->frames_walked;
+    resolved = ResolveJsonPath(tmpl, components, path_slot.num_components, stack->value);
+    if (resolved == nullptr) {
+      resolved = ResolveSlot<kProfiled>(state, path_slot.parent, stack->parent);
+    }
+  }
+  state->slots[slot] = resolved;
+  return resolved;
 }
 
-// Evaluates a SUBSTITUTION tag, by replacing its contents with the value of the tag's
-// name in 'parent_context'.
-int EvaluateSubstitution(const string& document, const int idx,
-    const ContextStack* context_stack, const OpCtx& op_ctx, stringstream* out) {
+// Looks up the value of the tag of 'op' in 'context_stack', going through its path slot
+// if the template has been optimized.
+template <bool kProfiled = false>
+const Value* ResolveOp(RenderState* state, const TemplateOp& op,
+    const ContextStack* context_stack) {
+  if (op.slot != -1) return ResolveSlot<kProfiled>(state, op.slot, context_stack);
   const Value* val;
-  ResolveJsonContext(op_ctx.tag_name, context_stack, &val);
-  if (val == nullptr) return idx;
+  int64_t frames_walked = 0;
+  ResolveJsonContext(string(state->tmpl->str(op.text), op.text_length), context_stack,
+      &val, &frames_walked);
+  if (kProfiled) {
+    ++state->profile->lookups;
+    state->profile->frames_walked += frames_walked;
+  }
+  return val;
+}
+
+// Given the value 'resolved' of the tag of a section opened by an 'op' tag with argument
+// 'arg', works out how the section should be evaluated. False or non-existant values
+// cause the section to be skipped, in which case this returns false. Otherwise 'context'
+// is set to the value that is pushed onto the context stack while evaluating the section;
+// if that value is an array, the section is evaluated once per element.
+//
+// NEGATED_SECTION_START has the opposite behaviour: false values cause the section to be
+// evaluated. Negated, predicate and (in)equality sections don't change the context: the
+// section is evaluated with the current context.
+bool ResolveSectionContext(int op, const char* arg, const Value* resolved,
+    const ContextStack* context_stack, const Value** context) {
+  *context = resolved;
+  bool skip_contents = false;
+  if (op == NEGATED_SECTION_START || op == PREDICATE_SECTION_START ||
+      op == SECTION_START) {
+    skip_contents = (*context == nullptr || (*context)->IsFalse());
+
+    // If the tag is a negative block (i.e. {{^tag_name}}), do the opposite: if the
+    // context exists and is true, skip the contents, else echo them.
+    if (op == NEGATED_SECTION_START) {
+      *context = context_stack->value;
+      skip_contents = !skip_contents;
+    } else if (op == PREDICATE_SECTION_START) {
+      *context = context_stack->value;
+    }
+  } else if (op == INEQUALITY || op == EQUALITY) {
+    skip_contents = (*context == nullptr || !(*context)->IsString() ||
+        strcasecmp((*context)->GetString(), arg) != 0);
+    if (op == INEQUALITY) skip_contents = !skip_contents;
+    *context = context_stack->value;
+  }
+  return !skip_contents;
+}
+
+// Evaluates a SUBSTITUTION tag, by replacing its contents with 'val', the value of the
+// tag's name. 'escaped' is true for triple-brace tags.
+void EvaluateSubstitution(bool escaped, const Value* val, stringstream* out) {
+  if (val == nullptr) return;
   if (val->IsString()) {
-    if (!op_ctx.escaped) {
-      EscapeHtml(val->GetString(), out);
+    if (!escaped) {
+      EscapeHtml(val->GetString(), val->GetStringLength(), out);
     } else {
       // TODO: Triple {{{ means don't escape
       (*out) << val->GetString();
@@ -341,108 +926,2600 @@ int EvaluateSubstitution(const string& document, const int idx,
   } else if (val->IsBool()) {
     (*out) << boolalpha << val->GetBool();
   }
-  return idx;
 }
 
 // Evaluates a LENGTH tag by replacing its contents with the type-dependent 'size' of the
 // value.
-int EvaluateLength(const string& document, const int idx, const ContextStack* context_stack,
-    const string& tag_name, stringstream* out) {
-  const Value* val;
-  ResolveJsonContext(tag_name, context_stack, &val);
-  if (val == nullptr) return idx;
+void EvaluateLength(const Value* val, stringstream* out) {
+  if (val == nullptr) return;
   if (val->IsArray()) {
     (*out) << val->Size();
   } else if (val->IsString()) {
     (*out) << val->GetStringLength();
   };
-
-  return idx;
 }
 
-int EvaluateLiteral(const string& document, const int idx, const ContextStack* context_stack,
-    const string& tag_name, stringstream* out) {
-  const Value* val;
-  ResolveJsonContext(tag_name, context_stack, &val);
-  if (val == nullptr) return idx;
-  if (!val->IsArray() && !val->IsObject()) return idx;
+void EvaluateLiteral(const Value* val, stringstream* out) {
+  if (val == nullptr) return;
+  if (!val->IsArray() && !val->IsObject()) return;
   StringBuffer strbuf;
   PrettyWriter<StringBuffer> writer(strbuf);
   val->Accept(writer);
   (*out) << strbuf.GetString();
-  return idx;
 }
 
-// Evaluates a 'partial' template by reading it fully from disk, then rendering it
-// directly into the current output with the current context.
-//
-// TODO: This could obviously be more efficient (and there are lots of file accesses in a
-// long list context).
-void EvaluatePartial(const string& tag_name, const string& document_root,
+// Loads the partial 'name' of 'tmpl' from its registry, counting the lookup in the
+// render metrics if they're enabled.
+shared_ptr<const CompiledTemplate> LoadPartial(const CompiledTemplate& tmpl,
+    const string& name);
+
+// Evaluates a 'partial' template by rendering it directly into the current output with
+// the current context. The partial is compiled once, the first time it is loaded from
+// the template's registry. Returns false if rendering the partial failed.
+bool EvaluatePartial(const CompiledTemplate& tmpl, const string& tag_name,
     const ContextStack* stack, stringstream* out) {
-  stringstream ss;
-  ss << document_root << tag_name;
-  ifstream tmpl(ss.str().c_str());
-  if (!tmpl.is_open()) {
-    ss << ".mustache";
-    tmpl.open(ss.str().c_str());
-    if (!tmpl.is_open()) return;
-  }
-  stringstream file_ss;
-  file_ss << tmpl.rdbuf();
-  RenderTemplate(file_ss.str(), document_root, stack, out);
-}
-
-// Given a tag name, and its operator, evaluate the tag in the given context and write the
-// output to 'out'. The heavy-lifting is delegated to specific Evaluate*()
-// methods. Returns the new cursor position within 'document', or -1 on error.
-int EvaluateTag(const string& document, const string& document_root, int idx,
-    const ContextStack* context, const OpCtx& op_ctx, stringstream* out) {
-  if (idx == -1) return idx;
-  switch (op_ctx.op) {
+  shared_ptr<const CompiledTemplate> partial = LoadPartial(tmpl, tag_name);
+  if (partial == nullptr) return true;
+  return RenderTemplate(*partial, stack, out);
+}
+
+#if defined(__GNUC__) && !defined(MUSTACHE_SWITCH_DISPATCH)
+static atomic<int> dispatch_mode(kThreadedDispatch);
+#else
+static atomic<int> dispatch_mode(kSwitchDispatch);
+#endif
+
+void SetDispatchMode(DispatchMode mode) {
+  dispatch_mode.store(mode);
+}
+
+DispatchMode GetDispatchMode() {
+  return static_cast<DispatchMode>(dispatch_mode.load());
+}
+
+static atomic<int> max_render_depth(10000);
+
+void SetMaxRenderDepth(int depth) {
+  max_render_depth.store(depth);
+}
+
+// The number of sections and partials being rendered on this thread, by all renders.
+static thread_local int render_depth = 0;
+
+// A section or partial being rendered by RenderOps(). These are kept on an explicit stack
+// on the heap rather than on the C++ call stack, so that deeply nested data or recursive
+// partials can't overflow it.
+struct RenderFrame {
+  // Where rendering continues once the frame is done.
+  int resume_pc;
+  int resume_end;
+  const ContextStack* outer;
+
+  // For sections: the first op of the body, the path slots of the body, and the array
+  // being iterated, if any, with the index of the current element. 'context' is the frame
+  // pushed onto the context stack for the current element.
+  int body;
+  int slots_begin;
+  int slots_end;
+  const Value* array;
+  SizeType index;
+  ContextStack context;
+
+  // For partials: the partial, and the template and slots of its caller. The static
+  // frames of a partial from Specialize() are pushed onto the context stack here.
+  shared_ptr<const CompiledTemplate> partial;
+  const CompiledTemplate* caller;
+  vector<const Value*> caller_slots;
+  vector<ContextStack> static_context;
+
+  // In profiled renders, the totals when the section or partial started.
+  ProfileSample sample;
+};
+
+// The frames of all renders on this thread, of which the first 'num_render_frames' are in
+// use. Renders that start while another is running, e.g. of partials in the closure
+// tier, use the frames above those of the outer render. Frames are never moved, so the
+// context stack can point into them, and are reused rather than freed, so that rendering
+// doesn't allocate once the stack has grown.
+static thread_local deque<RenderFrame> render_frames;
+static thread_local size_t num_render_frames = 0;
+
+RenderFrame* PushRenderFrame() {
+  if (num_render_frames == render_frames.size()) render_frames.emplace_back();
+  return &render_frames[num_render_frames++];
+}
+
+void PopRenderFrame() {
+  render_frames[--num_render_frames].partial.reset();
+}
+
+// An op lowered into a closure with all of its operands bound in, so that running it
+// needs no decoding of the op and no dispatch beyond one indirect call.
+typedef function<void(RenderState*, const ContextStack*)> OpClosure;
+
+// The number of templates being rendered by closures on this thread. Closures recurse
+// natively, so past kMaxClosureDepth templates are rendered by RenderOps() instead.
+static thread_local int closure_depth = 0;
+static const int kMaxClosureDepth = 64;
+
+const vector<OpClosure>* GetHotClosures(const CompiledTemplate& tmpl);
+static bool RenderTemplate(const CompiledTemplate& tmpl,
+    const vector<OpClosure>* closures, const ContextStack* stack, stringstream* out,
+    RenderProfile* profile);
+
+// Renders ops in the range [begin, end) of the template. Sections and partials are
+// entered and left in a loop, with their state in 'render_frames', rather than by
+// recursion. Each op is dispatched either through a switch or, with kThreaded, by
+// jumping straight from the handler of one op to the handler of the next through a table
+// of label addresses (a GCC extension also supported by Clang). Threaded dispatch saves
+// the bounds check of the switch and, more importantly, gives every handler its own
+// indirect branch, which the CPU predicts far better than one shared branch. Returns
+// false if the render nests deeper than SetMaxRenderDepth() allows.
+//
+// With kProfiled, every op other than literal text is timed and counted in
+// state->profile. Hot partials are then rendered by the interpreter too, so that their
+// ops are counted.
+template <bool kThreaded, bool kProfiled>
+bool RenderOps(RenderState* state, int begin, int end, const ContextStack* stack) {
+#ifdef __GNUC__
+  static void* const kHandlers[NONE] = {
+    &&substitution, // SUBSTITUTION
+    &&section, // SECTION_START
+    &&section, // NEGATED_SECTION_START
+    &&section, // PREDICATE_SECTION_START
+    &&next, // SECTION_END
+    &&partial, // PARTIAL
+    &&next, // COMMENT
+    &&length, // LENGTH
+    &&section, // EQUALITY
+    &&section, // INEQUALITY
+    &&literal, // LITERAL
+    &&text, // TEXT
+  };
+#define DISPATCH() \
+  do { \
+    if (pc >= end) goto body_end; \
+    if (kThreaded) goto *kHandlers[opcodes[pc]]; \
+    goto dispatch; \
+  } while (0)
+#else
+#define DISPATCH() \
+  do { \
+    if (pc >= end) goto body_end; \
+    goto dispatch; \
+  } while (0)
+#endif
+
+  const size_t base = num_render_frames;
+  const int max_depth = max_render_depth.load(memory_order_relaxed);
+  const CompiledTemplate* tmpl = state->tmpl;
+  const TemplateOp* ops = tmpl->ops.data();
+  const uint8_t* opcodes = tmpl->opcodes.data();
+  int pc = begin;
+  ProfileSample sample;
+  DISPATCH();
+
+ dispatch:
+  switch (opcodes[pc]) {
+    case TEXT: goto text;
     case SECTION_START:
     case PREDICATE_SECTION_START:
     case NEGATED_SECTION_START:
     case EQUALITY:
-    case INEQUALITY:
-      return EvaluateSection(document, document_root, idx, context, op_ctx, out);
-    case SUBSTITUTION:
-      return EvaluateSubstitution(document, idx, context, op_ctx, out);
-    case COMMENT:
-      return idx; // Ignored
-    case PARTIAL:
-      EvaluatePartial(op_ctx.tag_name, document_root, context, out);
-      return idx;
-    case LENGTH:
-      return EvaluateLength(document, idx, context, op_ctx.tag_name, out);
-    case LITERAL:
-      return EvaluateLiteral(document, idx, context, op_ctx.tag_name, out);
-    case NONE:
-      return idx; // No tag was found
-    case SECTION_END:
-      return idx;
-    default:
-      cout << "Unknown tag: " << op_ctx.op << endl;
-      return -1;
-  }
-}
-
-static bool RenderTemplate(const string& document, const string& document_root,
-                           const ContextStack* stack, stringstream* out) {
-  int idx = 0;
-  while (idx < document.size() && idx != -1) {
-    OpCtx op;
-    idx = FindNextTag(document, idx, &op, out);
-    idx = EvaluateTag(document, document_root, idx, stack, op, out);
+    case INEQUALITY: goto section;
+    case SUBSTITUTION: goto substitution;
+    case PARTIAL: goto partial;
+    case LENGTH: goto length;
+    case LITERAL: goto literal;
+    default: goto next;
+  }
+
+ text:
+  state->out->write(tmpl->text(ops[pc]), ops[pc].text_length);
+  ++pc;
+  DISPATCH();
+
+ substitution:
+  if (kProfiled) sample = state->profile->Start(tmpl, pc);
+  EvaluateSubstitution(ops[pc].escaped, ResolveOp<kProfiled>(state, ops[pc], stack),
+      state->out);
+  if (kProfiled) state->profile->Stop(tmpl, pc, sample);
+  ++pc;
+  DISPATCH();
+
+ length:
+  if (kProfiled) sample = state->profile->Start(tmpl, pc);
+  EvaluateLength(ResolveOp<kProfiled>(state, ops[pc], stack), state->out);
+  if (kProfiled) state->profile->Stop(tmpl, pc, sample);
+  ++pc;
+  DISPATCH();
+
+ literal:
+  if (kProfiled) sample = state->profile->Start(tmpl, pc);
+  EvaluateLiteral(ResolveOp<kProfiled>(state, ops[pc], stack), state->out);
+  if (kProfiled) state->profile->Stop(tmpl, pc, sample);
+  ++pc;
+  DISPATCH();
+
+ next:
+  ++pc;
+  DISPATCH();
+
+ section: {
+    // Evaluated once per value of the section's context (see ResolveSectionContext()).
+    const TemplateOp& op = ops[pc];
+    const Value* context;
+    if (kProfiled) sample = state->profile->Start(tmpl, pc);
+    if (!ResolveSectionContext(op.op, tmpl->str(op.arg),
+            ResolveOp<kProfiled>(state, op, stack), stack, &context) ||
+        (context->IsArray() && context->Size() == 0)) {
+      if (kProfiled) state->profile->Stop(tmpl, pc, sample);
+      pc = op.end + 1;
+      DISPATCH();
+    }
+    if (render_depth >= max_depth) {
+      if (kProfiled) state->profile->Stop(tmpl, pc, sample);
+      goto fail;
+    }
+    ++render_depth;
+    RenderFrame& frame = *PushRenderFrame();
+    frame.resume_pc = op.end + 1;
+    frame.resume_end = end;
+    frame.outer = stack;
+    frame.body = pc + 1;
+    frame.slots_begin = op.slots_begin;
+    frame.slots_end = op.slots_end;
+    frame.array = context->IsArray() ? context : nullptr;
+    frame.index = 0;
+    frame.context = { context, stack };
+    if (frame.array != nullptr) frame.context.value = &(*context)[SizeType(0)];
+    MUSTACHE_PROBE2(section__enter, tmpl->str(op.text),
+        frame.array != nullptr ? frame.array->Size() : 1);
+    frame.caller = nullptr;
+    frame.sample = sample;
+    // Each value of the section gets a fresh set of slots.
+    fill(state->slots.begin() + op.slots_begin, state->slots.begin() + op.slots_end,
+        &kUnresolved);
+    stack = &frame.context;
+    pc = frame.body;
+    end = op.end;
+    DISPATCH();
+  }
+
+ partial: {
+    const TemplateOp& op = ops[pc];
+    if (kProfiled) sample = state->profile->Start(tmpl, pc);
+    shared_ptr<const CompiledTemplate> partial =
+        LoadPartial(*tmpl, string(tmpl->str(op.text), op.text_length));
+    ++pc;
+    if (partial == nullptr) {
+      if (kProfiled) state->profile->Stop(tmpl, pc - 1, sample);
+      DISPATCH();
+    }
+    if (kProfiled) {
+      state->profile->AddTemplate(partial, string(tmpl->str(op.text), op.text_length));
+    }
+    // Partials that are hot are rendered by their closures, until closures nest too deep.
+    const vector<OpClosure>* closures = nullptr;
+    if (!kProfiled && closure_depth < kMaxClosureDepth &&
+        (closures = GetHotClosures(*partial)) != nullptr) {
+      if (!RenderTemplate(*partial, closures, stack, state->out, state->profile)) {
+        goto fail;
+      }
+      if (kProfiled) state->profile->Stop(tmpl, pc - 1, sample);
+      DISPATCH();
+    }
+    if (render_depth >= max_depth) {
+      if (kProfiled) state->profile->Stop(tmpl, pc - 1, sample);
+      goto fail;
+    }
+    ++render_depth;
+    RenderFrame& frame = *PushRenderFrame();
+    frame.resume_pc = pc;
+    frame.resume_end = end;
+    frame.outer = stack;
+    frame.array = nullptr;
+    frame.caller = tmpl;
+    frame.sample = sample;
+    frame.caller_slots.assign(partial->slots.size(), &kUnresolved);
+    state->slots.swap(frame.caller_slots);
+    // Reserved up front, so that the stack can point into it.
+    frame.static_context.clear();
+    frame.static_context.reserve(partial->static_frames.size());
+    for (const auto& static_frame: partial->static_frames) {
+      frame.static_context.push_back({ static_frame.get(), stack });
+      stack = &frame.static_context.back();
+    }
+    frame.partial = move(partial);
+    tmpl = state->tmpl = frame.partial.get();
+    ops = tmpl->ops.data();
+    opcodes = tmpl->opcodes.data();
+    pc = 0;
+    end = tmpl->ops.size();
+    DISPATCH();
+  }
+
+ body_end:
+  if (num_render_frames == base) return true;
+  {
+    RenderFrame& frame = render_frames[num_render_frames - 1];
+    if (frame.array != nullptr && ++frame.index < frame.array->Size()) {
+      fill(state->slots.begin() + frame.slots_begin,
+          state->slots.begin() + frame.slots_end, &kUnresolved);
+      frame.context.value = &(*frame.array)[frame.index];
+      pc = frame.body;
+      DISPATCH();
+    }
+    pc = frame.resume_pc;
+    end = frame.resume_end;
+    stack = frame.outer;
+    if (frame.caller == nullptr) {
+      MUSTACHE_PROBE1(section__exit, tmpl->str(ops[frame.body - 1].text));
+    } else {
+      state->slots.swap(frame.caller_slots);
+      tmpl = state->tmpl = frame.caller;
+      ops = tmpl->ops.data();
+      opcodes = tmpl->opcodes.data();
+    }
+    if (kProfiled) {
+      // The op that opened the frame, which is in the template being returned to.
+      int op = frame.caller != nullptr ? frame.resume_pc - 1 : frame.body - 1;
+      state->profile->Stop(tmpl, op, frame.sample);
+    }
+    PopRenderFrame();
+    --render_depth;
   }
+  DISPATCH();
 
-  return idx != -1;
+ fail:
+  for ( ; num_render_frames > base; PopRenderFrame()) {
+    RenderFrame& frame = render_frames[num_render_frames - 1];
+    if (frame.caller != nullptr) {
+      state->slots.swap(frame.caller_slots);
+      tmpl = state->tmpl = frame.caller;
+    }
+    // The ops that opened the frames stop as at body_end, so that the profile of a failed
+    // render has every op it started stopped.
+    if (kProfiled) {
+      int op = frame.caller != nullptr ? frame.resume_pc - 1 : frame.body - 1;
+      state->profile->Stop(tmpl, op, frame.sample);
+    }
+    --render_depth;
+  }
+  state->failed = true;
+  return false;
+#undef DISPATCH
 }
 
-bool RenderTemplate(const string& document, const string& document_root,
-    const Value& context, stringstream* out) {
-  ContextStack stack = { &context, nullptr };
-  return RenderTemplate(document, document_root, &stack, out);
+bool RenderOps(RenderState* state, int begin, int end, const ContextStack* stack) {
+  if (state->profile != nullptr) {
+#ifdef __GNUC__
+    if (state->dispatch == kThreadedDispatch) {
+      return RenderOps<true, true>(state, begin, end, stack);
+    }
+#endif
+    return RenderOps<false, true>(state, begin, end, stack);
+  }
+#ifdef __GNUC__
+  if (state->dispatch == kThreadedDispatch) {
+    return RenderOps<true, false>(state, begin, end, stack);
+  }
+#endif
+  return RenderOps<false, false>(state, begin, end, stack);
+}
+
+// Ways of resolving the path of a tag, for binding into closures. Each matches what
+// ResolveOp() does for a particular kind of op.
+struct SlotResolver {
+  int slot;
+  const Value* operator()(RenderState* state, const ContextStack* stack) const {
+    const Value* resolved = state->slots[slot];
+    return resolved != &kUnresolved ? resolved : ResolveSlot(state, slot, stack);
+  }
+};
+
+struct DotResolver {
+  const Value* operator()(RenderState* state, const ContextStack* stack) const {
+    return stack->value;
+  }
+};
+
+// A path with a single component.
+struct MemberResolver {
+  string name;
+  const Value* operator()(RenderState* state, const ContextStack* stack) const {
+    for ( ; stack != nullptr; stack = stack->parent) {
+      const Value* value = stack->value;
+      if (value->IsObject() && value->HasMember(name.c_str())) {
+        return &(*value)[name.c_str()];
+      }
+    }
+    return nullptr;
+  }
+};
+
+struct PathResolver {
+  vector<string> components;
+  const Value* operator()(RenderState* state, const ContextStack* stack) const {
+    for ( ; stack != nullptr; stack = stack->parent) {
+      const Value* resolved = ResolveJsonPath(components, stack->value);
+      if (resolved != nullptr) return resolved;
+    }
+    return nullptr;
+  }
+};
+
+// Calls 'lower' with the resolver for the tag of 'op'.
+template <typename Lower>
+OpClosure BindResolver(const CompiledTemplate& tmpl, const TemplateOp& op, Lower lower) {
+  if (op.slot != -1) return lower(SlotResolver{ op.slot });
+  string path(tmpl.str(op.text), op.text_length);
+  if (path == ".") return lower(DotResolver());
+  vector<string> components;
+  FindJsonPathComponents(path, &components);
+  if (components.size() == 1) return lower(MemberResolver{ components[0] });
+  return lower(PathResolver{ components });
+}
+
+void RunClosures(const vector<OpClosure>& closures, RenderState* state,
+    const ContextStack* stack) {
+  for (const OpClosure& closure: closures) {
+    closure(state, stack);
+    if (state->failed) return;
+  }
+}
+
+// Lowers the ops in [begin, end) of 'tmpl' into 'closures'. Mirrors RenderOps().
+void LowerOps(const CompiledTemplate& tmpl, int begin, int end,
+    vector<OpClosure>* closures) {
+  for (int pc = begin; pc < end; ++pc) {
+    const TemplateOp& op = tmpl.ops[pc];
+    switch (op.op) {
+      case TEXT: {
+        const char* text = tmpl.text(op);
+        size_t length = op.text_length;
+        closures->push_back([text, length](RenderState* state, const ContextStack*) {
+          state->out->write(text, length);
+        });
+        break;
+      }
+      case SUBSTITUTION:
+        closures->push_back(BindResolver(tmpl, op, [&op](auto resolve) -> OpClosure {
+          if (op.escaped) {
+            return [resolve](RenderState* state, const ContextStack* stack) {
+              const Value* val = resolve(state, stack);
+              if (val != nullptr && val->IsString()) {
+                (*state->out) << val->GetString();
+              } else {
+                EvaluateSubstitution(true, val, state->out);
+              }
+            };
+          }
+          return [resolve](RenderState* state, const ContextStack* stack) {
+            const Value* val = resolve(state, stack);
+            if (val != nullptr && val->IsString()) {
+              EscapeHtml(val->GetString(), val->GetStringLength(), state->out);
+            } else {
+              EvaluateSubstitution(false, val, state->out);
+            }
+          };
+        }));
+        break;
+      case LENGTH:
+        closures->push_back(BindResolver(tmpl, op, [](auto resolve) -> OpClosure {
+          return [resolve](RenderState* state, const ContextStack* stack) {
+            EvaluateLength(resolve(state, stack), state->out);
+          };
+        }));
+        break;
+      case LITERAL:
+        closures->push_back(BindResolver(tmpl, op, [](auto resolve) -> OpClosure {
+          return [resolve](RenderState* state, const ContextStack* stack) {
+            EvaluateLiteral(resolve(state, stack), state->out);
+          };
+        }));
+        break;
+      case SECTION_START:
+      case PREDICATE_SECTION_START:
+      case NEGATED_SECTION_START:
+      case EQUALITY:
+      case INEQUALITY: {
+        vector<OpClosure> body;
+        LowerOps(tmpl, pc + 1, op.end, &body);
+        int kind = op.op;
+        const char* name = tmpl.str(op.text);
+        const char* arg = tmpl.str(op.arg);
+        int slots_begin = op.slots_begin;
+        int slots_end = op.slots_end;
+        closures->push_back(BindResolver(tmpl, op, [&](auto resolve) -> OpClosure {
+          // Mirrors the section handler of RenderOps().
+          return [=](RenderState* state, const ContextStack* stack) {
+            const Value* context;
+            if (!ResolveSectionContext(kind, arg, resolve(state, stack), stack,
+                    &context)) {
+              return;
+            }
+            if (render_depth >= max_render_depth.load(memory_order_relaxed)) {
+              state->failed = true;
+              return;
+            }
+            ++render_depth;
+            MUSTACHE_PROBE2(section__enter, name,
+                context->IsArray() ? context->Size() : 1);
+            auto first_slot = state->slots.begin() + slots_begin;
+            auto last_slot = state->slots.begin() + slots_end;
+            if (context->IsArray()) {
+              for (int i = 0; i < context->Size() && !state->failed; ++i) {
+                fill(first_slot, last_slot, &kUnresolved);
+                ContextStack new_context = { &(*context)[i], stack };
+                RunClosures(body, state, &new_context);
+              }
+            } else {
+              fill(first_slot, last_slot, &kUnresolved);
+              ContextStack new_context = { context, stack };
+              RunClosures(body, state, &new_context);
+            }
+            MUSTACHE_PROBE1(section__exit, name);
+            --render_depth;
+          };
+        }));
+        pc = op.end;
+        break;
+      }
+      case PARTIAL: {
+        string name(tmpl.str(op.text), op.text_length);
+        closures->push_back([name](RenderState* state, const ContextStack* stack) {
+          if (!EvaluatePartial(*state->tmpl, name, stack, state->out)) {
+            state->failed = true;
+          }
+        });
+        break;
+      }
+      default:
+        break;
+    }
+  }
+}
+
+// Execution state shared by all copies of a compiled template.
+struct TemplateTier {
+  atomic<int64_t> renders{0};
+  atomic<bool> lowering{false};
+
+  // Set once the template is hot.
+  atomic<const vector<OpClosure>*> closures{nullptr};
+
+  ~TemplateTier() { delete closures.load(); }
+};
+
+shared_ptr<TemplateTier> NewTemplateTier() {
+  return make_shared<TemplateTier>();
+}
+
+size_t TemplateMemoryUsage(const CompiledTemplate& tmpl) {
+  return sizeof(CompiledTemplate) + tmpl.packed.size() +
+      (tmpl.tier != nullptr ? sizeof(TemplateTier) : 0);
+}
+
+uint64_t TemplateFingerprint(const CompiledTemplate& tmpl) {
+  return HashBytes(tmpl.source.data(), tmpl.source.size(),
+      HashBytes(tmpl.packed.data(), tmpl.packed.size()));
+}
+
+static atomic<int64_t> closure_tier_threshold(1000);
+
+void SetClosureTierThreshold(int64_t renders) {
+  closure_tier_threshold.store(renders);
+}
+
+// Counts a render of 'tmpl', and returns its closures if it is hot, lowering it the
+// first time. Returns nullptr while the template is cold, or while another thread is
+// lowering it.
+const vector<OpClosure>* GetHotClosures(const CompiledTemplate& tmpl) {
+  int64_t threshold = closure_tier_threshold.load(memory_order_relaxed);
+  TemplateTier* tier = tmpl.tier.get();
+  if (threshold == 0 || tier == nullptr) return nullptr;
+  const vector<OpClosure>* closures = tier->closures.load(memory_order_acquire);
+  if (closures != nullptr) return closures;
+  if (tier->renders.fetch_add(1, memory_order_relaxed) + 1 < threshold) return nullptr;
+  bool lowering = false;
+  if (!tier->lowering.compare_exchange_strong(lowering, true)) return nullptr;
+  vector<OpClosure>* lowered = new vector<OpClosure>();
+  LowerOps(tmpl, 0, tmpl.ops.size(), lowered);
+  tier->closures.store(lowered, memory_order_release);
+  return lowered;
+}
+
+static thread_local vector<vector<const Value*> > spare_slots;
+
+// Renders 'tmpl' with its closures if it has any, otherwise with RenderOps(). Profiled
+// renders, which have a 'profile', always use RenderOps().
+static bool RenderTemplate(const CompiledTemplate& tmpl,
+    const vector<OpClosure>* closures, const ContextStack* stack, stringstream* out,
+    RenderProfile* profile) {
+  if (render_depth >= max_render_depth.load(memory_order_relaxed)) return false;
+  // Static frames from Specialize() sit on top of the caller's context.
+  vector<ContextStack> static_frames;
+  static_frames.reserve(tmpl.static_frames.size());
+  for (const auto& frame: tmpl.static_frames) {
+    static_frames.push_back({ frame.get(), stack });
+    stack = &static_frames.back();
+  }
+  // Slot arrays are reused by later renders on this thread, so that rendering doesn't
+  // allocate.
+  vector<const Value*> slots;
+  if (!spare_slots.empty()) {
+    slots.swap(spare_slots.back());
+    spare_slots.pop_back();
+  }
+  slots.assign(tmpl.slots.size(), &kUnresolved);
+  RenderState state = { &tmpl, move(slots), out, dispatch_mode.load(memory_order_relaxed) };
+  state.profile = profile;
+  ++render_depth;
+  if (profile == nullptr && closures != nullptr && closure_depth < kMaxClosureDepth) {
+    ++closure_depth;
+    RunClosures(*closures, &state, stack);
+    --closure_depth;
+  } else {
+    RenderOps(&state, 0, tmpl.ops.size(), stack);
+  }
+  --render_depth;
+  spare_slots.push_back(move(state.slots));
+  return !state.failed;
+}
+
+static bool RenderTemplate(const CompiledTemplate& tmpl, const ContextStack* stack,
+                           stringstream* out) {
+  return RenderTemplate(tmpl, closure_depth < kMaxClosureDepth ? GetHotClosures(tmpl) :
+      nullptr, stack, out, nullptr);
+}
+
+// Renders 'tmpl', which is called 'name', or "" if it has none, as a render of its own
+// rather than as a partial.
+bool RenderTopLevel(const CompiledTemplate& tmpl, const string& name,
+    const Value& context, stringstream* out) {
+  MUSTACHE_PROBE2(render__start, name.c_str(), &tmpl);
+  ContextStack stack = { &context, nullptr };
+  bool rendered = RenderTemplate(tmpl, &stack, out);
+  MUSTACHE_PROBE3(render__done, name.c_str(), &tmpl, rendered);
+  return rendered;
+}
+
+bool RenderTemplate(const CompiledTemplate& tmpl, const Value& context, stringstream* out) {
+  return RenderTopLevel(tmpl, "", context, out);
+}
+
+// Returns the tag of 'op' as it would be written in a template.
+string DescribeTag(const CompiledTemplate& tmpl, const TemplateOp& op) {
+  string name(tmpl.str(op.text), op.text_length);
+  switch (op.op) {
+    case SUBSTITUTION: return op.escaped ? "{{{" + name + "}}}" : "{{" + name + "}}";
+    case SECTION_START: return "{{#" + name + "}}";
+    case NEGATED_SECTION_START: return "{{^" + name + "}}";
+    case PREDICATE_SECTION_START: return "{{?" + name + "}}";
+    case PARTIAL: return "{{>" + name + "}}";
+    case LENGTH: return "{{%" + name + "}}";
+    case LITERAL: return "{{~" + name + "}}";
+    case EQUALITY: return "{{=" + name + " " + tmpl.str(op.arg) + "}}";
+    case INEQUALITY: return "{{!=" + name + " " + tmpl.str(op.arg) + "}}";
+    default: return name;
+  }
+}
+
+// Returns the frame of the folded stack for node 'node' of 'profile': the template's
+// name for the root and for partials, and the tag otherwise.
+string StackFrameName(RenderProfile& profile, const StackNode& node) {
+  string name;
+  if (node.op == -1) {
+    name = profile.templates[node.tmpl].first;
+    if (name.empty()) name = "template";
+  } else if (node.tmpl->ops[node.op].op == PARTIAL) {
+    const TemplateOp& op = node.tmpl->ops[node.op];
+    name.assign(node.tmpl->str(op.text), op.text_length);
+  } else {
+    name = DescribeTag(*node.tmpl, node.tmpl->ops[node.op]);
+  }
+  // ';' separates frames, and each stack is one line.
+  replace_if(name.begin(), name.end(), [](char c) { return c == ';' || c == '\n'; }, '_');
+  return name;
+}
+
+// Renders 'tmpl', which is called 'name', and profiles the render into 'stats'.
+bool ProfileTemplate(const CompiledTemplate& tmpl, const string& name,
+    const Value& context, stringstream* out, RenderStats* stats) {
+  RenderProfile profile(out, &tmpl);
+  profile.templates[&tmpl] = make_pair(name, nullptr);
+  ContextStack stack = { &context, nullptr };
+  MUSTACHE_PROBE2(render__start, name.c_str(), &tmpl);
+  ProfileSample start = profile.Sample();
+  bool rendered = RenderTemplate(tmpl, nullptr, &stack, out, &profile);
+  ProfileSample end = profile.Sample();
+  MUSTACHE_PROBE3(render__done, name.c_str(), &tmpl, rendered);
+
+  stats->nanoseconds = end.nanoseconds - start.nanoseconds;
+  stats->bytes = end.bytes - start.bytes;
+  profile.nodes[0].nanoseconds = stats->nanoseconds;
+  profile.nodes[0].bytes = stats->bytes;
+
+  // Nodes come after their parents, so each node's stack is built from its parent's, and
+  // the cost of its children is taken off its own going backwards.
+  stats->stacks.resize(profile.nodes.size());
+  for (size_t i = 0; i < profile.nodes.size(); ++i) {
+    const StackNode& node = profile.nodes[i];
+    StackStats& stack = stats->stacks[i];
+    stack.stack = StackFrameName(profile, node);
+    if (node.parent != -1) {
+      stack.stack = stats->stacks[node.parent].stack + ";" + stack.stack;
+    }
+    stack.nanoseconds = node.nanoseconds;
+    stack.bytes = node.bytes;
+  }
+  for (size_t i = profile.nodes.size() - 1; i > 0; --i) {
+    StackStats& parent = stats->stacks[profile.nodes[i].parent];
+    parent.nanoseconds -= profile.nodes[i].nanoseconds;
+    parent.bytes -= profile.nodes[i].bytes;
+  }
+
+  stats->tags.clear();
+  for (auto& entry: profile.ops) {
+    const CompiledTemplate* op_tmpl = entry.first.first;
+    TagStats& tag = entry.second;
+    tag.template_name = profile.templates[op_tmpl].first;
+    int op = entry.first.second;
+    if (op_tmpl->offsets[op] != kNoOffset) tag.offset = op_tmpl->offsets[op];
+    tag.tag = DescribeTag(*op_tmpl, op_tmpl->ops[op]);
+    stats->tags.push_back(move(tag));
+  }
+  stable_sort(stats->tags.begin(), stats->tags.end(),
+      [](const TagStats& a, const TagStats& b) { return a.nanoseconds > b.nanoseconds; });
+  return rendered;
+}
+
+bool RenderTemplate(const CompiledTemplate& tmpl, const Value& context, stringstream* out,
+    RenderStats* stats) {
+  return ProfileTemplate(tmpl, "", context, out, stats);
+}
+
+void WriteFoldedStacks(const vector<StackStats>& stacks, StackWeight weight,
+    ostream* out) {
+  map<string, int64_t> folded;
+  for (const StackStats& stack: stacks) {
+    folded[stack.stack] += weight == kWeighByBytes ? stack.bytes : stack.nanoseconds;
+  }
+  for (const auto& stack: folded) {
+    // Timer skew can leave a frame's own time a little below zero.
+    if (stack.second > 0) (*out) << stack.first << " " << stack.second << "\n";
+  }
+}
+
+// The cache behind SetRenderCacheBudget(). Split into shards, each with its own lock and
+// LRU list, so that threads rendering different templates rarely contend.
+class RenderCache {
+ public:
+  void SetBudget(size_t max_bytes) {
+    budget_.store(max_bytes);
+    for (Shard& shard: shards_) {
+      lock_guard<mutex> l(shard.lock);
+      Evict(max_bytes / kNumShards, &shard);
+    }
+  }
+
+  bool enabled() const { return budget_.load(memory_order_relaxed) != 0; }
+
+  // Returns the compiled form of 'document', compiling it on a miss. Sets 'tmpl' to
+  // nullptr if the template is malformed.
+  void Get(const string& document, const string& document_root,
+      shared_ptr<const CompiledTemplate>* tmpl) {
+    uint64_t key = hash<string>()(document) * 31 + hash<string>()(document_root);
+    Shard& shard = shards_[key % kNumShards];
+    {
+      lock_guard<mutex> l(shard.lock);
+      auto it = shard.index.find(key);
+      if (it != shard.index.end() && it->second->document == document &&
+          it->second->document_root == document_root) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        ++shard.stats.hits;
+        *tmpl = it->second->tmpl;
+        return;
+      }
+      ++shard.stats.misses;
+    }
+
+    MUSTACHE_PROBE2(cache__miss, "render", document.c_str());
+
+    // Compile outside the lock, as TemplateRegistry::Get() does.
+    shared_ptr<CompiledTemplate> compiled = make_shared<CompiledTemplate>();
+    if (!CompileTemplate(document, document_root, compiled.get())) compiled.reset();
+    *tmpl = compiled;
+    size_t bytes = sizeof(Entry) + document.size() + document_root.size() +
+        (compiled != nullptr ? TemplateMemoryUsage(*compiled) : 0);
+    size_t budget = budget_.load() / kNumShards;
+    if (bytes > budget) return;
+
+    lock_guard<mutex> l(shard.lock);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      // Another thread compiled the same template, or a different one with the same hash.
+      shard.stats.bytes -= it->second->bytes;
+      shard.lru.erase(it->second);
+      shard.index.erase(it);
+    }
+    shard.lru.push_front({ key, document, document_root, compiled, bytes });
+    shard.index[key] = shard.lru.begin();
+    shard.stats.bytes += bytes;
+    Evict(budget, &shard);
+  }
+
+  RenderCacheStats GetStats() {
+    RenderCacheStats stats;
+    for (Shard& shard: shards_) {
+      lock_guard<mutex> l(shard.lock);
+      stats.hits += shard.stats.hits;
+      stats.misses += shard.stats.misses;
+      stats.evictions += shard.stats.evictions;
+      stats.bytes += shard.stats.bytes;
+    }
+    return stats;
+  }
+
+ private:
+  static const int kNumShards = 16;
+
+  struct Entry {
+    uint64_t hash;
+    string document;
+    string document_root;
+    shared_ptr<const CompiledTemplate> tmpl;
+    size_t bytes;
+  };
+
+  struct Shard {
+    mutex lock;
+    // Most recently used first.
+    list<Entry> lru;
+    unordered_map<uint64_t, list<Entry>::iterator> index;
+    RenderCacheStats stats;
+  };
+
+  // Drops least recently used entries from 'shard' until it fits in 'budget'.
+  void Evict(size_t budget, Shard* shard) {
+    while (shard->stats.bytes > budget) {
+      shard->stats.bytes -= shard->lru.back().bytes;
+      shard->index.erase(shard->lru.back().hash);
+      shard->lru.pop_back();
+      ++shard->stats.evictions;
+    }
+  }
+
+  atomic<size_t> budget_{0};
+  Shard shards_[kNumShards];
+};
+
+static RenderCache render_cache;
+
+void SetRenderCacheBudget(size_t max_bytes) {
+  render_cache.SetBudget(max_bytes);
+}
+
+RenderCacheStats GetRenderCacheStats() {
+  return render_cache.GetStats();
+}
+
+bool RenderTemplate(const string& document, const string& document_root,
+    const Value& context, stringstream* out) {
+  if (render_cache.enabled()) {
+    shared_ptr<const CompiledTemplate> tmpl;
+    render_cache.Get(document, document_root, &tmpl);
+    return tmpl != nullptr && RenderTemplate(*tmpl, context, out);
+  }
+  CompiledTemplate tmpl;
+  if (!CompileTemplate(document, document_root, &tmpl)) return false;
+  return RenderTemplate(tmpl, context, out);
+}
+
+// Render metrics (see SetRenderMetrics()). Counters are split into shards, which threads
+// are assigned to in turn, so that up to kMetricShards threads rendering the same
+// template each write to their own shard; beyond that, threads share shards, and so
+// atomics. The counters of each shard are aligned to a cache line, so shards don't
+// share lines.
+static const int kMetricShards = 16;
+
+static atomic<bool> render_metrics_enabled(false);
+static atomic<size_t> max_metric_series(1000);
+static atomic<int> next_metric_shard(0);
+static thread_local int metric_shard = next_metric_shard.fetch_add(1) % kMetricShards;
+
+// The number of lookups on this thread that had to go to a registry's source, i.e. that
+// missed its cache of compiled templates.
+static thread_local int64_t registry_misses = 0;
+
+void SetRenderMetrics(bool enabled, size_t max_series) {
+  max_metric_series.store(max_series);
+  render_metrics_enabled.store(enabled);
+}
+
+// Returns the object in 'slot', first creating it if there is none. Threads that race to
+// create it agree on the one that was stored first.
+template <typename T>
+T* GetOrCreate(atomic<T*>* slot) {
+  T* value = slot->load(memory_order_acquire);
+  if (value != nullptr) return value;
+  T* created = new T();
+  if (slot->compare_exchange_strong(value, created, memory_order_acq_rel)) return created;
+  delete created;
+  return value;
+}
+
+// Latencies are counted in log-linear buckets, as in an HDR histogram: values below 16ns
+// have a bucket each, and every power of two above that is split into 16 buckets, so a
+// bucket is never wider than 1/16th of the values in it. Latencies are capped at 2^40ns
+// (about 18 minutes). The buckets of each power of two are a group, which is only
+// allocated once a latency falls in it, so a template whose renders take similar times
+// only holds a few groups.
+static const int kLatencySubBucketBits = 4;
+static const int kLatencyGroups = 37;
+static const int kLatencyBuckets = kLatencyGroups << kLatencySubBucketBits;
+static const int64_t kMaxLatency = (int64_t(1) << 40) - 1;
+
+int LatencyBucket(int64_t nanoseconds) {
+  uint64_t value = min(max<int64_t>(nanoseconds, 0), kMaxLatency);
+  if (value < (1 << kLatencySubBucketBits)) return value;
+  int shift = 63 - __builtin_clzll(value) - kLatencySubBucketBits;
+  return ((shift + 1) << kLatencySubBucketBits) +
+      ((value >> shift) & ((1 << kLatencySubBucketBits) - 1));
+}
+
+// Returns the largest value counted in 'bucket'.
+int64_t LatencyBucketMax(int bucket) {
+  if (bucket < (1 << kLatencySubBucketBits)) return bucket;
+  int shift = (bucket >> kLatencySubBucketBits) - 1;
+  int64_t first = int64_t((1 << kLatencySubBucketBits) +
+      (bucket & ((1 << kLatencySubBucketBits) - 1))) << shift;
+  return first + (int64_t(1) << shift) - 1;
+}
+
+struct LatencyGroup {
+  LatencyGroup() : buckets() { }
+  atomic<int64_t> buckets[1 << kLatencySubBucketBits];
+};
+
+enum LookupKind {
+  kTemplateLookup,
+  kPartialLookup,
+  kNumLookupKinds
+};
+
+// The metrics of one template, as counted by the threads of one shard.
+struct alignas(64) TemplateMetrics {
+  TemplateMetrics() : lookups(), misses(), latency() { }
+  ~TemplateMetrics() {
+    for (auto& group: latency) delete group.load();
+  }
+
+  // Plain operator new only guarantees 16-byte alignment before C++17.
+  static void* operator new(size_t size) {
+    void* memory;
+    if (posix_memalign(&memory, alignof(TemplateMetrics), size) != 0) throw bad_alloc();
+    return memory;
+  }
+  static void operator delete(void* memory) { free(memory); }
+
+  void CountLatency(int64_t nanoseconds) {
+    int bucket = LatencyBucket(nanoseconds);
+    LatencyGroup* group = GetOrCreate(&latency[bucket >> kLatencySubBucketBits]);
+    group->buckets[bucket & ((1 << kLatencySubBucketBits) - 1)].fetch_add(1,
+        memory_order_relaxed);
+  }
+
+  void CountLookup(LookupKind kind, bool miss) {
+    lookups[kind].fetch_add(1, memory_order_relaxed);
+    if (miss) misses[kind].fetch_add(1, memory_order_relaxed);
+  }
+
+  atomic<int64_t> renders{0};
+  atomic<int64_t> errors{0};
+  atomic<int64_t> bytes{0};
+  atomic<int64_t> nanoseconds{0};
+  atomic<int64_t> lookups[kNumLookupKinds];
+  atomic<int64_t> misses[kNumLookupKinds];
+  atomic<LatencyGroup*> latency[kLatencyGroups];
+};
+
+// The metrics of one template in one registry. The metrics of a shard are allocated when
+// one of its threads first uses them.
+struct MetricSeries {
+  MetricSeries() : shards() { }
+  ~MetricSeries() {
+    for (auto& shard: shards) delete shard.load();
+  }
+
+  atomic<TemplateMetrics*> shards[kMetricShards];
+};
+
+// Metrics of several shards added together.
+struct MergedMetrics {
+  RenderMetrics metrics;
+  vector<int64_t> latency = vector<int64_t>(kLatencyBuckets);
+};
+
+// Returns the latency below which 'quantile' of the renders counted in 'latency' fall.
+int64_t LatencyQuantile(const vector<int64_t>& latency, double quantile) {
+  int64_t count = 0;
+  for (int64_t n: latency) count += n;
+  if (count == 0) return 0;
+  int64_t rank = max<int64_t>(1, ceil(quantile * count));
+  for (int bucket = 0; bucket < kLatencyBuckets; ++bucket) {
+    rank -= latency[bucket];
+    if (rank <= 0) return LatencyBucketMax(bucket);
+  }
+  return kMaxLatency;
+}
+
+// A series is identified by the metrics name of a registry and a template name.
+typedef pair<string, string> SeriesKey;
+
+class RenderMetricsRegistry {
+ public:
+  // Returns the metrics of the template called 'name' in the registry called 'registry'
+  // for this thread's shard. Once there are max_metric_series series, templates without
+  // one are counted in the registry's series for "". Each thread remembers the metrics it
+  // has used, so this only takes a lock the first time a thread renders a template, or
+  // every time for templates counted in "".
+  TemplateMetrics* Get(const string& registry, const string& name) {
+    static thread_local unordered_map<string,
+        unordered_map<string, TemplateMetrics*> > cache;
+    unordered_map<string, TemplateMetrics*>& names = cache[registry];
+    auto cached = names.find(name);
+    if (cached != names.end()) return cached->second;
+
+    lock_guard<mutex> l(lock_);
+    SeriesKey key(registry, name);
+    auto it = series_.find(key);
+    bool overflowed = false;
+    if (it == series_.end() && !name.empty() &&
+        series_.size() >= max_metric_series.load()) {
+      key.second.clear();
+      it = series_.find(key);
+      overflowed = true;
+    }
+    if (it == series_.end()) {
+      it = series_.insert(make_pair(key, unique_ptr<MetricSeries>(new MetricSeries())))
+          .first;
+    }
+    TemplateMetrics* metrics = GetOrCreate(&it->second->shards[metric_shard]);
+    // Not remembered past the cap, so that unbounded names can't grow the cache.
+    if (!overflowed) names[name] = metrics;
+    return metrics;
+  }
+
+  // Adds up the metrics of all shards, by registry and template name.
+  void Merge(map<SeriesKey, MergedMetrics>* merged) {
+    lock_guard<mutex> l(lock_);
+    for (const auto& series: series_) {
+      MergedMetrics& total = (*merged)[series.first];
+      for (const auto& shard: series.second->shards) {
+        const TemplateMetrics* metrics = shard.load();
+        if (metrics == nullptr) continue;
+        total.metrics.renders += metrics->renders.load(memory_order_relaxed);
+        total.metrics.errors += metrics->errors.load(memory_order_relaxed);
+        total.metrics.bytes += metrics->bytes.load(memory_order_relaxed);
+        total.metrics.nanoseconds += metrics->nanoseconds.load(memory_order_relaxed);
+        total.metrics.template_lookups +=
+            metrics->lookups[kTemplateLookup].load(memory_order_relaxed);
+        total.metrics.template_misses +=
+            metrics->misses[kTemplateLookup].load(memory_order_relaxed);
+        total.metrics.partial_lookups +=
+            metrics->lookups[kPartialLookup].load(memory_order_relaxed);
+        total.metrics.partial_misses +=
+            metrics->misses[kPartialLookup].load(memory_order_relaxed);
+        for (int i = 0; i < kLatencyGroups; ++i) {
+          const LatencyGroup* group = metrics->latency[i].load(memory_order_acquire);
+          if (group == nullptr) continue;
+          for (int j = 0; j < (1 << kLatencySubBucketBits); ++j) {
+            total.latency[(i << kLatencySubBucketBits) + j] +=
+                group->buckets[j].load(memory_order_relaxed);
+          }
+        }
+      }
+    }
+    for (auto& entry: *merged) {
+      RenderMetrics& metrics = entry.second.metrics;
+      metrics.p50_nanoseconds = LatencyQuantile(entry.second.latency, 0.5);
+      metrics.p99_nanoseconds = LatencyQuantile(entry.second.latency, 0.99);
+      metrics.p999_nanoseconds = LatencyQuantile(entry.second.latency, 0.999);
+    }
+  }
+
+ private:
+  mutex lock_;
+  map<SeriesKey, unique_ptr<MetricSeries> > series_;
+};
+
+static RenderMetricsRegistry render_metrics;
+
+shared_ptr<const CompiledTemplate> LoadPartial(const CompiledTemplate& tmpl,
+    const string& name) {
+  int64_t misses = registry_misses;
+  shared_ptr<const CompiledTemplate> partial = tmpl.registry->Get(name);
+  MUSTACHE_PROBE3(partial__load, name.c_str(), partial.get(), registry_misses != misses);
+  if (render_metrics_enabled.load(memory_order_relaxed)) {
+    render_metrics.Get(tmpl.registry->metrics_name(),
+        partial != nullptr ? name : string())->CountLookup(kPartialLookup,
+            registry_misses != misses);
+  }
+  return partial;
+}
+
+// Slow render capture (see SetSlowRenderCapture()). The threshold is checked on every
+// measured render, and the rate limit on every slow one; the rest is only touched when a
+// render is captured.
+static atomic<int64_t> slow_render_threshold(0);
+static atomic<int64_t> capture_interval(0);
+static atomic<int64_t> next_capture_allowed(0);
+static atomic<bool> capturing(false);
+static mutex capture_lock;
+static string capture_directory;
+static int max_captures = 1;
+static int next_capture = 0;
+
+string CapturePath(const string& directory, int capture) {
+  return directory + "/capture-" + to_string(capture) + ".json";
+}
+
+bool SetSlowRenderCapture(int64_t threshold_nanoseconds, const string& directory,
+    int max_count, int max_per_second) {
+  lock_guard<mutex> l(capture_lock);
+  // Turning captures off leaves the directory and its ring as they were.
+  if (threshold_nanoseconds == 0) {
+    slow_render_threshold.store(0);
+    return true;
+  }
+  if (directory.empty()) {
+    slow_render_threshold.store(0);
+    return false;
+  }
+  capture_interval.store(max_per_second > 0 ? 1000000000 / max_per_second : 0);
+  next_capture_allowed.store(0);
+  capture_directory = directory;
+  max_captures = max(max_count, 1);
+  // Carry on after the newest capture already in the directory, so that a restarted
+  // process overwrites the oldest captures first.
+  next_capture = 0;
+  struct timespec newest = { 0, 0 };
+  for (int i = 0; i < max_captures; ++i) {
+    struct stat st;
+    if (stat(CapturePath(directory, i).c_str(), &st) != 0) continue;
+    if (st.st_mtim.tv_sec > newest.tv_sec ||
+        (st.st_mtim.tv_sec == newest.tv_sec && st.st_mtim.tv_nsec >= newest.tv_nsec)) {
+      newest = st.st_mtim;
+      next_capture = (i + 1) % max_captures;
+    }
+  }
+  slow_render_threshold.store(threshold_nanoseconds);
+  return true;
+}
+
+// Returns true if a slow render that finished at 'now' may be captured, in which case
+// FinishCapture() must be called when it has been. Renders are dropped if there has
+// been a capture in the last capture_interval nanoseconds or one is under way.
+bool StartCapture(int64_t now) {
+  if (now < next_capture_allowed.load(memory_order_relaxed)) return false;
+  if (capturing.exchange(true, memory_order_acquire)) return false;
+  // Another thread may have made a capture since the first check.
+  if (now < next_capture_allowed.load(memory_order_relaxed)) {
+    capturing.store(false, memory_order_release);
+    return false;
+  }
+  next_capture_allowed.store(now + capture_interval.load(memory_order_relaxed),
+      memory_order_relaxed);
+  return true;
+}
+
+void FinishCapture() {
+  capturing.store(false, memory_order_release);
+}
+
+// Writes a capture of a render of 'tmpl', called 'name', with 'context' that took
+// 'nanoseconds' and wrote 'bytes'. The template is rendered again, profiled, to record
+// where the time went.
+void CaptureSlowRender(const CompiledTemplate& tmpl, const string& name,
+    const Value& context, int64_t nanoseconds, int64_t bytes) {
+  stringstream scratch;
+  RenderStats stats;
+  ProfileTemplate(tmpl, name, context, &scratch, &stats);
+
+  StringBuffer buffer;
+  Writer<StringBuffer> writer(buffer);
+  writer.StartObject();
+  writer.String("template");
+  writer.String(name.c_str(), name.size());
+  // As a string, since json numbers don't hold 64 bits.
+  char fingerprint[17];
+  snprintf(fingerprint, sizeof(fingerprint), "%016llx",
+      static_cast<unsigned long long>(TemplateFingerprint(tmpl)));
+  writer.String("fingerprint");
+  writer.String(fingerprint);
+  writer.String("time");
+  writer.Int64(chrono::duration_cast<chrono::seconds>(
+      chrono::system_clock::now().time_since_epoch()).count());
+  writer.String("nanoseconds");
+  writer.Int64(nanoseconds);
+  writer.String("bytes");
+  writer.Int64(bytes);
+  writer.String("context");
+  context.Accept(writer);
+  writer.String("stats");
+  writer.StartObject();
+  writer.String("nanoseconds");
+  writer.Int64(stats.nanoseconds);
+  writer.String("bytes");
+  writer.Int64(stats.bytes);
+  writer.String("tags");
+  writer.StartArray();
+  for (const TagStats& tag: stats.tags) {
+    writer.StartObject();
+    writer.String("template");
+    writer.String(tag.template_name.c_str(), tag.template_name.size());
+    writer.String("offset");
+    writer.Int(tag.offset);
+    writer.String("tag");
+    writer.String(tag.tag.c_str(), tag.tag.size());
+    writer.String("count");
+    writer.Int64(tag.count);
+    writer.String("nanoseconds");
+    writer.Int64(tag.nanoseconds);
+    writer.String("bytes");
+    writer.Int64(tag.bytes);
+    writer.String("lookups");
+    writer.Int64(tag.lookups);
+    writer.String("frames_walked");
+    writer.Int64(tag.frames_walked);
+    writer.EndObject();
+  }
+  writer.EndArray();
+  writer.EndObject();
+  writer.EndObject();
+
+  string path;
+  {
+    lock_guard<mutex> l(capture_lock);
+    path = CapturePath(capture_directory, next_capture);
+    next_capture = (next_capture + 1) % max_captures;
+  }
+  // Written to the side and renamed into place, as WriteRenderMetrics() does.
+  string temp_path = path + ".tmp";
+  {
+    ofstream out(temp_path.c_str());
+    out << buffer.GetString();
+    out.close();
+    if (!out) return;
+  }
+  rename(temp_path.c_str(), path.c_str());
+}
+
+// True if renders by TemplateRegistry::Render() need to be timed, for the render
+// metrics or to capture slow renders.
+bool MeasureRenders() {
+  return render_metrics_enabled.load(memory_order_relaxed) ||
+      slow_render_threshold.load(memory_order_relaxed) != 0;
+}
+
+// Renders the template called 'name' from 'registry', profiled into 'stats' if it is
+// set. Counts the render in the metrics of 'name' if they're enabled, and captures it if
+// it's slow.
+bool RenderAndMeasure(TemplateRegistry* registry, const string& name,
+    const Value& context, stringstream* out, RenderStats* stats) {
+  int64_t start = NowNanoseconds();
+  int64_t start_bytes = out->tellp();
+  int64_t misses = registry_misses;
+  shared_ptr<const CompiledTemplate> tmpl = registry->Get(name);
+  bool rendered = tmpl != nullptr && (stats != nullptr ?
+      ProfileTemplate(*tmpl, name, context, out, stats) :
+      RenderTopLevel(*tmpl, name, context, out));
+  int64_t end = NowNanoseconds();
+  int64_t nanoseconds = end - start;
+  int64_t bytes = static_cast<int64_t>(out->tellp()) - start_bytes;
+
+  if (render_metrics_enabled.load(memory_order_relaxed)) {
+    // Names that don't exist are all counted together, so they can't add series.
+    TemplateMetrics* metrics = render_metrics.Get(registry->metrics_name(),
+        tmpl != nullptr ? name : string());
+    metrics->CountLookup(kTemplateLookup, registry_misses != misses);
+    metrics->renders.fetch_add(1, memory_order_relaxed);
+    if (!rendered) metrics->errors.fetch_add(1, memory_order_relaxed);
+    metrics->bytes.fetch_add(bytes, memory_order_relaxed);
+    metrics->nanoseconds.fetch_add(nanoseconds, memory_order_relaxed);
+    metrics->CountLatency(nanoseconds);
+  }
+  int64_t threshold = slow_render_threshold.load(memory_order_relaxed);
+  if (threshold != 0 && nanoseconds >= threshold && tmpl != nullptr &&
+      StartCapture(end)) {
+    CaptureSlowRender(*tmpl, name, context, nanoseconds, bytes);
+    FinishCapture();
+  }
+  return rendered;
+}
+
+RenderMetrics GetRenderMetrics(const string& name, const string& registry) {
+  map<SeriesKey, MergedMetrics> merged;
+  render_metrics.Merge(&merged);
+  auto it = merged.find(SeriesKey(registry, name));
+  return it == merged.end() ? RenderMetrics() : it->second.metrics;
+}
+
+// Escapes 'value' for use as a label value in the Prometheus text format.
+string EscapeLabel(const string& value) {
+  string escaped;
+  for (char c: value) {
+    if (c == '\\' || c == '"') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+// Returns the Prometheus labels of the series 'key'.
+string SeriesLabels(const SeriesKey& key) {
+  return "registry=\"" + EscapeLabel(key.first) + "\",template=\"" +
+      EscapeLabel(key.second) + "\"";
+}
+
+string ExportRenderMetrics() {
+  map<SeriesKey, MergedMetrics> merged;
+  render_metrics.Merge(&merged);
+  stringstream out;
+  out << "# HELP mustache_renders_total Renders by TemplateRegistry::Render().\n"
+      << "# TYPE mustache_renders_total counter\n";
+  for (const auto& entry: merged) {
+    out << "mustache_renders_total{" << SeriesLabels(entry.first) << "} "
+        << entry.second.metrics.renders << "\n";
+  }
+  out << "# HELP mustache_render_errors_total Renders that failed, or whose template "
+         "couldn't be loaded.\n"
+      << "# TYPE mustache_render_errors_total counter\n";
+  for (const auto& entry: merged) {
+    out << "mustache_render_errors_total{" << SeriesLabels(entry.first) << "} "
+        << entry.second.metrics.errors << "\n";
+  }
+  out << "# HELP mustache_render_output_bytes_total Bytes rendered.\n"
+      << "# TYPE mustache_render_output_bytes_total counter\n";
+  for (const auto& entry: merged) {
+    out << "mustache_render_output_bytes_total{" << SeriesLabels(entry.first) << "} "
+        << entry.second.metrics.bytes << "\n";
+  }
+  out << "# HELP mustache_render_latency_seconds Time taken by renders.\n"
+      << "# TYPE mustache_render_latency_seconds summary\n";
+  for (const auto& entry: merged) {
+    const RenderMetrics& metrics = entry.second.metrics;
+    string label = SeriesLabels(entry.first);
+    const pair<const char*, int64_t> quantiles[] = {
+      { "0.5", metrics.p50_nanoseconds },
+      { "0.99", metrics.p99_nanoseconds },
+      { "0.999", metrics.p999_nanoseconds },
+    };
+    for (const auto& quantile: quantiles) {
+      out << "mustache_render_latency_seconds{" << label << ",quantile=\""
+          << quantile.first << "\"} " << quantile.second / 1e9 << "\n";
+    }
+    out << "mustache_render_latency_seconds_sum{" << label << "} "
+        << metrics.nanoseconds / 1e9 << "\n"
+        << "mustache_render_latency_seconds_count{" << label << "} "
+        << metrics.renders << "\n";
+  }
+
+  out << "# HELP mustache_registry_lookups_total Lookups of templates and partials in "
+         "registries.\n"
+      << "# TYPE mustache_registry_lookups_total counter\n";
+  for (const auto& entry: merged) {
+    const RenderMetrics& metrics = entry.second.metrics;
+    string label = SeriesLabels(entry.first);
+    out << "mustache_registry_lookups_total{" << label << ",kind=\"template\"} "
+        << metrics.template_lookups << "\n"
+        << "mustache_registry_lookups_total{" << label << ",kind=\"partial\"} "
+        << metrics.partial_lookups << "\n";
+  }
+  out << "# HELP mustache_registry_misses_total Lookups that had to load the template "
+         "from its source.\n"
+      << "# TYPE mustache_registry_misses_total counter\n";
+  for (const auto& entry: merged) {
+    const RenderMetrics& metrics = entry.second.metrics;
+    string label = SeriesLabels(entry.first);
+    out << "mustache_registry_misses_total{" << label << ",kind=\"template\"} "
+        << metrics.template_misses << "\n"
+        << "mustache_registry_misses_total{" << label << ",kind=\"partial\"} "
+        << metrics.partial_misses << "\n";
+  }
+
+  RenderCacheStats cache = GetRenderCacheStats();
+  out << "# HELP mustache_render_cache_hits_total Hits in the cache of templates "
+         "rendered from text.\n"
+      << "# TYPE mustache_render_cache_hits_total counter\n"
+      << "mustache_render_cache_hits_total " << cache.hits << "\n"
+      << "# HELP mustache_render_cache_misses_total Misses in the cache of templates "
+         "rendered from text.\n"
+      << "# TYPE mustache_render_cache_misses_total counter\n"
+      << "mustache_render_cache_misses_total " << cache.misses << "\n"
+      << "# HELP mustache_render_cache_bytes Memory used by the cache of templates "
+         "rendered from text.\n"
+      << "# TYPE mustache_render_cache_bytes gauge\n"
+      << "mustache_render_cache_bytes " << cache.bytes << "\n";
+  return out.str();
+}
+
+bool WriteRenderMetrics(const string& path) {
+  // Written to the side and renamed into place, so that readers never see half a file.
+  string temp_path = path + ".tmp";
+  {
+    ofstream out(temp_path.c_str());
+    out << ExportRenderMetrics();
+    out.close();
+    if (!out) return false;
+  }
+  return rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+// Adds 'path' to the paths used in the scope 'scope' and in all the scopes that enclose
+// it, so that a section can fall back to the resolution made by its enclosing scope.
+void AddScopePath(const string& path, int scope, const vector<int>& scope_parents,
+    vector<vector<string> >* scope_paths) {
+  for ( ; scope != -1; scope = scope_parents[scope]) {
+    vector<string>& paths = (*scope_paths)[scope];
+    if (find(paths.begin(), paths.end(), path) != paths.end()) return;
+    paths.push_back(path);
+  }
+}
+
+void OptimizeTemplate(TemplateBuilder* tmpl) {
+  tmpl->slots.clear();
+
+  // Scope 0 is the top level of the template, and every section adds a scope for its
+  // contents. First, find the paths that are looked up in each scope.
+  vector<int> scope_parents = { -1 };
+  vector<int> scope_ops = { -1 };
+  vector<vector<string> > scope_paths(1);
+  vector<int> op_scopes(tmpl->ops.size());
+  int scope = 0;
+  for (int pc = 0; pc < tmpl->ops.size(); ++pc) {
+    OpBuilder& op = tmpl->ops[pc];
+    op.slot = -1;
+    if (op.op == SECTION_END) {
+      scope = scope_parents[scope];
+      continue;
+    }
+    op_scopes[pc] = scope;
+    if (op.op == TEXT || op.op == PARTIAL) continue;
+    // '.' is always the innermost frame, so doesn't need a slot.
+    if (op.text != ".") AddScopePath(op.text, scope, scope_parents, &scope_paths);
+    if (op.end != -1) {
+      scope_parents.push_back(scope);
+      scope_ops.push_back(pc);
+      scope_paths.push_back(vector<string>());
+      scope = scope_parents.size() - 1;
+    }
+  }
+
+  // Then give each scope a contiguous range of slots, so that they can be reset together
+  // whenever the scope is entered.
+  vector<map<string, int> > scope_slots(scope_paths.size());
+  for (int i = 0; i < scope_paths.size(); ++i) {
+    if (scope_ops[i] != -1) tmpl->ops[scope_ops[i]].slots_begin = tmpl->slots.size();
+    for (const string& path: scope_paths[i]) {
+      SlotBuilder slot;
+      FindJsonPathComponents(path, &slot.components);
+      if (scope_parents[i] != -1) slot.parent = scope_slots[scope_parents[i]][path];
+      scope_slots[i][path] = tmpl->slots.size();
+      tmpl->slots.push_back(slot);
+    }
+    if (scope_ops[i] != -1) tmpl->ops[scope_ops[i]].slots_end = tmpl->slots.size();
+  }
+
+  for (int pc = 0; pc < tmpl->ops.size(); ++pc) {
+    OpBuilder& op = tmpl->ops[pc];
+    if (op.op == TEXT || op.op == PARTIAL || op.op == SECTION_END || op.text == ".") {
+      continue;
+    }
+    op.slot = scope_slots[op_scopes[pc]][op.text];
+  }
+}
+
+// Appends ops [begin, end] of 'tmpl' to 'ops' unchanged, apart from re-basing the
+// section links.
+void CopyOps(const TemplateBuilder& tmpl, int begin, int end, vector<OpBuilder>* ops) {
+  int delta = ops->size() - begin;
+  for (int pc = begin; pc <= end; ++pc) {
+    ops->push_back(tmpl.ops[pc]);
+    if (ops->back().end != -1) ops->back().end += delta;
+  }
+}
+
+// Partially evaluates ops [begin, end) of 'tmpl' with respect to 'static_stack', and
+// appends the result to 'ops'. Every frame of 'static_stack' is known to be innermost at
+// render time, so any path that resolves in it resolves identically when rendering; paths
+// that don't resolve are left to be evaluated against the dynamic context.
+//
+// If 'require_static' is true, the range must fold entirely into literal text, and this
+// returns false as soon as it finds an op that depends on the dynamic context.
+bool SpecializeOps(const TemplateBuilder& tmpl, int begin, int end,
+    const ContextStack* static_stack, bool require_static, vector<OpBuilder>* ops) {
+  for (int pc = begin; pc < end; ++pc) {
+    const OpBuilder& op = tmpl.ops[pc];
+    const Value* val = nullptr;
+    if (op.op != TEXT) ResolveJsonContext(op.text, static_stack, &val);
+
+    switch (op.op) {
+      case TEXT:
+        AppendText(op.text, ops, op.source);
+        break;
+      case SUBSTITUTION:
+      case LENGTH:
+      case LITERAL: {
+        if (val == nullptr) {
+          if (require_static) return false;
+          ops->push_back(op);
+          break;
+        }
+        stringstream ss;
+        if (op.op == SUBSTITUTION) {
+          EvaluateSubstitution(op.escaped, val, &ss);
+        } else if (op.op == LENGTH) {
+          EvaluateLength(val, &ss);
+        } else {
+          EvaluateLiteral(val, &ss);
+        }
+        AppendText(ss.str(), ops);
+        break;
+      }
+      case SECTION_START:
+      case PREDICATE_SECTION_START:
+      case NEGATED_SECTION_START:
+      case EQUALITY:
+      case INEQUALITY: {
+        const Value* context;
+        if (val != nullptr &&
+            !ResolveSectionContext(op.op, op.arg.c_str(), val, static_stack, &context)) {
+          // Known to be skipped: drop the whole section.
+          pc = op.end;
+          break;
+        }
+
+        if (op.op != SECTION_START) {
+          // Whether or not the condition is known, the body is evaluated with the
+          // current context and so can be specialized in place.
+          ContextStack new_context = { static_stack->value, static_stack };
+          if (val != nullptr) {
+            if (!SpecializeOps(tmpl, pc + 1, op.end, &new_context, require_static, ops)) {
+              return false;
+            }
+          } else {
+            if (require_static) return false;
+            int start = ops->size();
+            ops->push_back(op);
+            if (!SpecializeOps(tmpl, pc + 1, op.end, &new_context, false, ops)) {
+              return false;
+            }
+            OpBuilder section_end = tmpl.ops[op.end];
+            section_end.end = start;
+            (*ops)[start].end = ops->size();
+            ops->push_back(section_end);
+          }
+          pc = op.end;
+          break;
+        }
+
+        // A section that pushes a new context can only be folded if its contents fold
+        // completely for every value; otherwise it is kept as it is.
+        vector<OpBuilder> folded;
+        bool is_static = (val != nullptr);
+        if (is_static && context->IsArray()) {
+          for (int i = 0; is_static && i < context->Size(); ++i) {
+            ContextStack new_context = { &(*context)[i], static_stack };
+            is_static = SpecializeOps(tmpl, pc + 1, op.end, &new_context, true, &folded);
+          }
+        } else if (is_static) {
+          ContextStack new_context = { context, static_stack };
+          is_static = SpecializeOps(tmpl, pc + 1, op.end, &new_context, true, &folded);
+        }
+        if (is_static) {
+          for (const OpBuilder& folded_op: folded) {
+            AppendText(folded_op.text, ops, folded_op.source);
+          }
+        } else {
+          if (require_static) return false;
+          CopyOps(tmpl, pc, op.end, ops);
+        }
+        pc = op.end;
+        break;
+      }
+      case PARTIAL:
+        if (require_static) return false;
+        ops->push_back(op);
+        break;
+      default:
+        ops->push_back(op);
+        break;
+    }
+  }
+  return true;
+}
+
+bool Specialize(const CompiledTemplate& tmpl, const Value& static_context,
+    CompiledTemplate* specialized) {
+  // Copy 'static_context' into a document owned by the specialized template.
+  StringBuffer buffer;
+  Writer<StringBuffer> writer(buffer);
+  static_context.Accept(writer);
+  shared_ptr<Document> frame = make_shared<Document>();
+  frame->Parse<0>(buffer.GetString());
+  if (frame->HasParseError()) return false;
+
+  // Any existing static frames are known as well.
+  vector<shared_ptr<const Document> > static_frames = tmpl.static_frames;
+  static_frames.push_back(frame);
+  vector<ContextStack> static_stack;
+  static_stack.reserve(static_frames.size());
+  for (const auto& f: static_frames) {
+    static_stack.push_back({ f.get(), static_stack.empty() ? nullptr : &static_stack.back() });
+  }
+
+  TemplateBuilder builder;
+  UnpackTemplate(tmpl, &builder);
+  TemplateBuilder result;
+  if (!SpecializeOps(builder, 0, builder.ops.size(), &static_stack.back(), false,
+          &result.ops)) {
+    return false;
+  }
+  if (!tmpl.slots.empty()) OptimizeTemplate(&result);
+  specialized->source = tmpl.source;
+  specialized->source_storage = tmpl.source_storage;
+  PackTemplate(result, specialized);
+  specialized->registry = tmpl.registry;
+  specialized->static_frames = static_frames;
+  return true;
+}
+
+// A read-only mapping of a whole file, unmapped when the last template using it goes.
+struct MappedFile {
+  const char* data = nullptr;
+  size_t size = 0;
+
+  ~MappedFile() {
+    if (data != nullptr) munmap(const_cast<char*>(data), size);
+  }
+};
+
+bool FileTemplateSource::Read(const string& name, string* contents) {
+  for (const string& path: { root_ + name, root_ + name + ".mustache" }) {
+    ifstream tmpl(path.c_str(), ios::binary);
+    if (!tmpl.is_open()) continue;
+    // Read straight into 'contents', rather than through a stringstream, which would copy
+    // the whole file twice more.
+    tmpl.seekg(0, ios::end);
+    streamoff size = tmpl.tellg();
+    if (size < 0) continue; // Not a regular file
+    contents->resize(size);
+    tmpl.seekg(0, ios::beg);
+    tmpl.read(&(*contents)[0], size);
+    return true;
+  }
+  return false;
+}
+
+bool FileTemplateSource::Map(const string& name, TemplateText* text) {
+  if (mmap_threshold_ == 0) return false;
+  for (const string& path: { root_ + name, root_ + name + ".mustache" }) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) continue;
+    struct stat st;
+    shared_ptr<MappedFile> file = make_shared<MappedFile>();
+    bool is_file = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (is_file && st.st_size >= mmap_threshold_) {
+      void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        file->data = static_cast<const char*>(data);
+        file->size = st.st_size;
+      }
+    }
+    close(fd);
+    if (!is_file) continue;
+    if (file->data == nullptr) return false;
+    text->text = ArrayView<char>(file->data, file->size);
+    text->storage = file;
+    return true;
+  }
+  return false;
+}
+
+int64_t FileTemplateSource::GetVersion(const string& name) {
+  struct stat st;
+  string path = root_ + name;
+  if (stat(path.c_str(), &st) != 0) {
+    path += ".mustache";
+    if (stat(path.c_str(), &st) != 0) return 0;
+  }
+  int64_t mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  return (mtime_ns ^ (static_cast<int64_t>(st.st_size) << 40)) | 1;
+}
+
+void MemoryTemplateSource::Add(const string& name, const string& contents) {
+  lock_guard<mutex> l(lock_);
+  templates_[name] = make_pair(contents, next_version_++);
+}
+
+bool MemoryTemplateSource::Read(const string& name, string* contents) {
+  lock_guard<mutex> l(lock_);
+  auto it = templates_.find(name);
+  if (it == templates_.end()) return false;
+  *contents = it->second.first;
+  return true;
+}
+
+int64_t MemoryTemplateSource::GetVersion(const string& name) {
+  lock_guard<mutex> l(lock_);
+  auto it = templates_.find(name);
+  return it == templates_.end() ? 0 : it->second.second;
+}
+
+EmbeddedTemplateSource::EmbeddedTemplateSource(const EmbeddedTemplate* templates,
+    int count) {
+  for (int i = 0; i < count; ++i) templates_[templates[i].name] = &templates[i];
+}
+
+bool EmbeddedTemplateSource::Read(const string& name, string* contents) {
+  auto it = templates_.find(name);
+  if (it == templates_.end()) it = templates_.find(name + ".mustache");
+  if (it == templates_.end()) return false;
+  contents->assign(it->second->contents, it->second->length);
+  return true;
+}
+
+// A process-wide table of compiled templates by content, behind
+// CompileOptions::deduplicate. Templates whose packed form and source are byte for byte
+// the same share one copy of both, and one set of render counters, whatever registry,
+// name or root they were compiled under. Entries don't keep templates alive: each copy
+// is freed with the last template that uses it.
+class TemplateInterner {
+ public:
+  // Points 'tmpl' at the shared copy of its contents, or makes it the shared copy if
+  // there isn't one.
+  void Intern(CompiledTemplate* tmpl) {
+    uint64_t key = TemplateFingerprint(*tmpl);
+    lock_guard<mutex> l(lock_);
+    auto range = entries_.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+      Entry& entry = it->second;
+      shared_ptr<const void> storage = entry.storage.lock();
+      shared_ptr<const void> source_storage = entry.source_storage.lock();
+      shared_ptr<TemplateTier> tier = entry.tier.lock();
+      if (storage == nullptr || (!entry.source.empty() && source_storage == nullptr) ||
+          !Equal(entry.packed, tmpl->packed) || !Equal(entry.source, tmpl->source)) {
+        continue;
+      }
+      AttachPackedTemplate(entry.packed.data(), entry.packed.size(), false, tmpl);
+      tmpl->storage = storage;
+      tmpl->source = entry.source;
+      tmpl->source_storage = source_storage;
+      if (tier != nullptr) tmpl->tier = tier;
+      ++stats_.hits;
+      return;
+    }
+    entries_.insert({ key, { tmpl->packed, tmpl->storage, tmpl->source,
+        tmpl->source_storage, tmpl->tier } });
+    // Drop the entries of freed templates whenever the table has doubled.
+    if (entries_.size() >= 2 * live_entries_) {
+      for (auto it = entries_.begin(); it != entries_.end(); ) {
+        it = it->second.storage.expired() ? entries_.erase(it) : next(it);
+      }
+      live_entries_ = max<size_t>(entries_.size(), 64);
+    }
+  }
+
+  InternedTemplateStats GetStats() {
+    lock_guard<mutex> l(lock_);
+    InternedTemplateStats stats = stats_;
+    for (const auto& entry: entries_) {
+      if (entry.second.storage.expired()) continue;
+      ++stats.unique;
+      stats.bytes += entry.second.packed.size();
+    }
+    return stats;
+  }
+
+ private:
+  struct Entry {
+    ArrayView<char> packed;
+    weak_ptr<const void> storage;
+    ArrayView<char> source;
+    weak_ptr<const void> source_storage;
+    weak_ptr<TemplateTier> tier;
+  };
+
+  static bool Equal(const ArrayView<char>& a, const ArrayView<char>& b) {
+    return a.size() == b.size() &&
+        (a.empty() || memcmp(a.data(), b.data(), a.size()) == 0);
+  }
+
+  mutex lock_;
+  unordered_multimap<uint64_t, Entry> entries_;
+  size_t live_entries_ = 64;
+  InternedTemplateStats stats_;
+};
+
+static TemplateInterner template_interner;
+
+InternedTemplateStats GetInternedTemplateStats() {
+  return template_interner.GetStats();
+}
+
+TemplateRegistry::TemplateRegistry(shared_ptr<TemplateSource> source,
+    bool check_for_updates, const CompileOptions& options)
+  : source_(source),
+    check_for_updates_(check_for_updates),
+    options_(options) {
+  options_.registry = this;
+}
+
+shared_ptr<const CompiledTemplate> TemplateRegistry::Get(const string& name) {
+  if (frozen_.load(memory_order_acquire)) {
+    auto it = templates_.find(name);
+    return it == templates_.end() ? nullptr : it->second.tmpl;
+  }
+  int64_t version = 0;
+  if (check_for_updates_) version = source_->GetVersion(name);
+  {
+    lock_guard<mutex> l(lock_);
+    auto it = templates_.find(name);
+    if (it != templates_.end() && (!check_for_updates_ || it->second.version == version)) {
+      return it->second.tmpl;
+    }
+  }
+  ++registry_misses;
+  MUSTACHE_PROBE2(cache__miss, "registry", name.c_str());
+
+  // Compile outside the lock, so that loading one template doesn't block lookups of
+  // others. Two threads may race to load the same template, in which case both compile
+  // it and the last one wins.
+  TemplateText text;
+  if (source_->Map(name, &text)) return Compile(name, text, version);
+  string contents;
+  if (!source_->Read(name, &contents)) {
+    lock_guard<mutex> l(lock_);
+    if (!frozen_.load(memory_order_relaxed)) templates_[name] = { nullptr, version };
+    return nullptr;
+  }
+  return Compile(name, { ArrayView<char>(contents.data(), contents.size()), nullptr },
+      version);
+}
+
+shared_ptr<const CompiledTemplate> TemplateRegistry::Compile(const string& name,
+    const string& contents) {
+  if (frozen_.load(memory_order_acquire)) return nullptr;
+  return Compile(name, { ArrayView<char>(contents.data(), contents.size()), nullptr },
+      check_for_updates_ ? source_->GetVersion(name) : 0);
+}
+
+shared_ptr<const CompiledTemplate> TemplateRegistry::Compile(const string& name,
+    const TemplateText& text, int64_t version) {
+  shared_ptr<CompiledTemplate> tmpl = make_shared<CompiledTemplate>();
+  templates_being_compiled.push_back(make_pair(this, name));
+  if (!CompileTemplate(text, "", tmpl.get(), options_)) {
+    tmpl.reset();
+  } else if (options_.deduplicate) {
+    template_interner.Intern(tmpl.get());
+  }
+  templates_being_compiled.pop_back();
+  lock_guard<mutex> l(lock_);
+  // Readers of a frozen registry don't take the lock, so it must not change.
+  if (frozen_.load(memory_order_relaxed)) return nullptr;
+  templates_[name] = { tmpl, version };
+  return tmpl;
+}
+
+bool TemplateRegistry::Render(const string& name, const Value& context,
+    stringstream* out) {
+  if (MeasureRenders()) return RenderAndMeasure(this, name, context, out, nullptr);
+  shared_ptr<const CompiledTemplate> tmpl = Get(name);
+  if (tmpl == nullptr) return false;
+  return RenderTopLevel(*tmpl, name, context, out);
+}
+
+bool TemplateRegistry::Render(const string& name, const Value& context,
+    stringstream* out, RenderStats* stats) {
+  if (MeasureRenders()) return RenderAndMeasure(this, name, context, out, stats);
+  shared_ptr<const CompiledTemplate> tmpl = Get(name);
+  if (tmpl == nullptr) return false;
+  return ProfileTemplate(*tmpl, name, context, out, stats);
+}
+
+bool TemplateRegistry::Add(const string& name, shared_ptr<const CompiledTemplate> tmpl) {
+  int64_t version = check_for_updates_ ? source_->GetVersion(name) : 0;
+  lock_guard<mutex> l(lock_);
+  if (frozen_.load(memory_order_relaxed)) return false;
+  templates_[name] = { tmpl, version };
+  return true;
+}
+
+bool TemplateRegistry::Clear() {
+  lock_guard<mutex> l(lock_);
+  if (frozen_.load(memory_order_relaxed)) return false;
+  templates_.clear();
+  return true;
+}
+
+void TemplateRegistry::SetMetricsName(const string& name) {
+  metrics_name_ = name;
+}
+
+void TemplateRegistry::Freeze() {
+  lock_guard<mutex> l(lock_);
+  frozen_.store(true, memory_order_release);
+}
+
+// A template bundle starts with this header, followed by an entry for each template, the
+// template names and finally the packed templates, each aligned to 8 bytes.
+struct BundleHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_templates;
+};
+
+struct BundleEntry {
+  // Offsets are from the start of the bundle.
+  uint64_t name;
+  uint64_t name_length;
+  uint64_t offset;
+  uint64_t size;
+};
+
+static const char kBundleMagic[8] = { 'M', 'U', 'S', 'T', 'B', 'N', 'D', 'L' };
+static const uint32_t kBundleVersion = 3;
+
+bool WriteTemplateBundle(const string& path,
+    const map<string, shared_ptr<const CompiledTemplate> >& templates) {
+  BundleHeader header;
+  memcpy(header.magic, kBundleMagic, sizeof(header.magic));
+  header.version = kBundleVersion;
+  header.num_templates = templates.size();
+
+  // Templates that refer to their source text are packed again with the text copied in,
+  // so that each is self-contained.
+  map<string, shared_ptr<const CompiledTemplate> > packed;
+  for (const auto& tmpl: templates) {
+    if (tmpl.second == nullptr || tmpl.second->source.empty()) {
+      packed.insert(tmpl);
+      continue;
+    }
+    TemplateBuilder builder;
+    UnpackTemplate(*tmpl.second, &builder);
+    shared_ptr<CompiledTemplate> copy = make_shared<CompiledTemplate>();
+    PackTemplate(builder, copy.get());
+    copy->static_frames = tmpl.second->static_frames;
+    packed[tmpl.first] = copy;
+  }
+
+  vector<BundleEntry> entries;
+  string names;
+  uint64_t offset = sizeof(BundleHeader) + templates.size() * sizeof(BundleEntry);
+  for (const auto& tmpl: packed) {
+    if (tmpl.second == nullptr || !tmpl.second->static_frames.empty()) return false;
+    entries.push_back({ offset + names.size(), tmpl.first.size(), 0,
+        tmpl.second->packed.size() });
+    names.append(tmpl.first);
+    names.push_back('\0');
+  }
+  offset += names.size();
+  for (BundleEntry& entry: entries) {
+    offset = (offset + 7) & ~7ULL;
+    entry.offset = offset;
+    offset += entry.size;
+  }
+
+  ofstream out(path.c_str(), ios::binary | ios::trunc);
+  if (!out.is_open()) return false;
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(entries.data()),
+      entries.size() * sizeof(BundleEntry));
+  out.write(names.data(), names.size());
+  int i = 0;
+  for (const auto& tmpl: packed) {
+    static const char kPadding[8] = { 0 };
+    out.write(kPadding, entries[i].offset - out.tellp());
+    out.write(tmpl.second->packed.data(), tmpl.second->packed.size());
+    ++i;
+  }
+  out.close();
+  return out.good();
+}
+
+bool LoadTemplateBundle(const string& path, TemplateRegistry* registry,
+    const BundleOptions& options) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) return false;
+  struct stat st;
+  shared_ptr<MappedFile> file = make_shared<MappedFile>();
+  if (fstat(fd, &st) == 0 && st.st_size >= sizeof(BundleHeader)) {
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      file->data = static_cast<const char*>(data);
+      file->size = st.st_size;
+    }
+  }
+  close(fd);
+  if (file->data == nullptr) return false;
+#ifdef MADV_HUGEPAGE
+  if (options.huge_pages) madvise(const_cast<char*>(file->data), file->size, MADV_HUGEPAGE);
+#endif
+
+  const BundleHeader* header = reinterpret_cast<const BundleHeader*>(file->data);
+  if (memcmp(header->magic, kBundleMagic, sizeof(kBundleMagic)) != 0 ||
+      header->version != kBundleVersion ||
+      sizeof(BundleHeader) + static_cast<uint64_t>(header->num_templates) *
+      sizeof(BundleEntry) > file->size) {
+    return false;
+  }
+  const BundleEntry* entries =
+      reinterpret_cast<const BundleEntry*>(file->data + sizeof(BundleHeader));
+  vector<pair<string, shared_ptr<CompiledTemplate> > > templates;
+  for (int i = 0; i < header->num_templates; ++i) {
+    const BundleEntry& entry = entries[i];
+    if (entry.name > file->size || entry.name_length > file->size - entry.name ||
+        entry.offset > file->size || entry.size > file->size - entry.offset ||
+        entry.offset % 8 != 0) {
+      return false;
+    }
+    shared_ptr<CompiledTemplate> tmpl = make_shared<CompiledTemplate>();
+    if (!AttachPackedTemplate(file->data + entry.offset, entry.size, options.verify,
+            tmpl.get())) {
+      return false;
+    }
+    tmpl->storage = file;
+    tmpl->registry = registry;
+    templates.push_back(
+        make_pair(string(file->data + entry.name, entry.name_length), tmpl));
+  }
+  for (const auto& tmpl: templates) {
+    if (!registry->Add(tmpl.first, tmpl.second)) return false;
+  }
+  return true;
+}
+
+TemplateRegistry* FileTemplateRegistry(const string& root, bool check_for_updates) {
+  // Callers usually use the same root over and over, so each thread remembers the last
+  // one it looked up, and doesn't take the lock for it.
+  static thread_local string last_root;
+  static thread_local bool last_check_for_updates = false;
+  static thread_local TemplateRegistry* last_registry = nullptr;
+  if (last_registry != nullptr && last_root == root &&
+      last_check_for_updates == check_for_updates) {
+    return last_registry;
+  }
+
+  static mutex registries_lock;
+  static map<pair<string, bool>, unique_ptr<TemplateRegistry> >* registries =
+      new map<pair<string, bool>, unique_ptr<TemplateRegistry> >();
+  lock_guard<mutex> l(registries_lock);
+  unique_ptr<TemplateRegistry>& registry =
+      (*registries)[make_pair(root, check_for_updates)];
+  if (registry == nullptr) {
+    registry.reset(new TemplateRegistry(make_shared<FileTemplateSource>(root),
+        check_for_updates));
+    registry->SetMetricsName(root);
+  }
+  last_root = root;
+  last_check_for_updates = check_for_updates;
+  last_registry = registry.get();
+  return registry.get();
+}
+
+// Appends the names of the .mustache files under 'root' + 'dir' to 'names'.
+void FindTemplates(const string& root, const string& dir, vector<string>* names) {
+  static const string kExtension = ".mustache";
+  DIR* d = opendir((root + dir).c_str());
+  if (d == nullptr) return;
+  while (struct dirent* entry = readdir(d)) {
+    string path = dir + entry->d_name;
+    struct stat st;
+    if (entry->d_name[0] == '.' || stat((root + path).c_str(), &st) != 0) continue;
+    if (S_ISDIR(st.st_mode)) {
+      FindTemplates(root, path + "/", names);
+    } else if (ends_with(path, kExtension)) {
+      names->push_back(path.substr(0, path.size() - kExtension.size()));
+    }
+  }
+  closedir(d);
+}
+
+// Appends the names of the partials that 'document' refers to to 'partials'.
+void FindPartials(const string& document, vector<string>* partials) {
+  int idx = 0;
+  while (idx < document.size()) {
+    OpCtx op;
+    idx = FindNextTag(ArrayView<char>(document.data(), document.size()), idx, &op,
+        nullptr);
+    if (op.op == PARTIAL) partials->push_back(op.tag_name);
+  }
+}
+
+// Calls 'fn' for every i in [0, n), from up to 'threads' threads.
+void ParallelFor(int n, int threads, const function<void(int)>& fn) {
+  atomic<int> next(0);
+  auto worker = [&]() {
+    for (int i = next++; i < n; i = next++) fn(i);
+  };
+  vector<thread> workers;
+  for (int i = 1; i < min(threads, n); ++i) workers.emplace_back(worker);
+  worker();
+  for (thread& t: workers) t.join();
+}
+
+// A template found by CompileDirectory(), and its place in the graph of partials.
+struct DirectoryTemplate {
+  string name;
+  bool found = false;
+  string contents;
+  vector<string> partial_names;
+  vector<int> partials;
+
+  // Index of the strongly connected component, i.e. the group of templates that are
+  // mutually recursive, that the template belongs to. Assigned by FindComponents().
+  int component = -1;
+  int index = -1;
+  int lowlink = -1;
+  bool on_stack = false;
+};
+
+// Tarjan's algorithm. Components are numbered in the order they are completed, which is
+// after every component that they depend on.
+void FindComponents(vector<DirectoryTemplate>* templates, int i, int* next_index,
+    vector<int>* stack, int* num_components) {
+  DirectoryTemplate& tmpl = (*templates)[i];
+  tmpl.index = tmpl.lowlink = (*next_index)++;
+  stack->push_back(i);
+  tmpl.on_stack = true;
+  for (int partial: tmpl.partials) {
+    DirectoryTemplate& p = (*templates)[partial];
+    if (p.index == -1) {
+      FindComponents(templates, partial, next_index, stack, num_components);
+      tmpl.lowlink = min(tmpl.lowlink, p.lowlink);
+    } else if (p.on_stack) {
+      tmpl.lowlink = min(tmpl.lowlink, p.index);
+    }
+  }
+  if (tmpl.lowlink != tmpl.index) return;
+  int member;
+  do {
+    member = stack->back();
+    stack->pop_back();
+    (*templates)[member].on_stack = false;
+    (*templates)[member].component = *num_components;
+  } while (member != i);
+  ++*num_components;
+}
+
+// Compiles the templates under 'root', and the partials they use, into 'registry' (see
+// CompileDirectory()). If 'previous' is set, templates that aren't named in 'changed'
+// and use no partials that changed are copied from 'previous' rather than compiled again.
+bool CompileTree(const string& root, int threads, TemplateRegistry* registry,
+    TemplateRegistry* previous, const set<string>& changed,
+    CompileDirectoryReport* report) {
+  if (threads <= 0) threads = max(1U, thread::hardware_concurrency());
+  FileTemplateSource source(root);
+
+  // Read and scan the templates in the directory, then any partials they refer to that
+  // are outside it, until every reference has been followed.
+  vector<string> names;
+  FindTemplates(root, "", &names);
+  sort(names.begin(), names.end());
+  vector<DirectoryTemplate> templates(names.size());
+  map<string, int> indices;
+  for (int i = 0; i < names.size(); ++i) {
+    templates[i].name = names[i];
+    indices[names[i]] = i;
+  }
+  for (int scanned = 0; scanned < templates.size(); ) {
+    int begin = scanned;
+    scanned = templates.size();
+    ParallelFor(scanned - begin, threads, [&](int i) {
+      DirectoryTemplate& tmpl = templates[begin + i];
+      tmpl.found = source.Read(tmpl.name, &tmpl.contents);
+      FindPartials(tmpl.contents, &tmpl.partial_names);
+    });
+    for (int i = begin; i < scanned; ++i) {
+      for (const string& partial: templates[i].partial_names) {
+        auto it = indices.insert(make_pair(partial, templates.size())).first;
+        if (it->second == templates.size()) {
+          templates.push_back(DirectoryTemplate());
+          templates.back().name = partial;
+        }
+        templates[i].partials.push_back(it->second);
+      }
+      vector<int>& partials = templates[i].partials;
+      sort(partials.begin(), partials.end());
+      partials.erase(unique(partials.begin(), partials.end()), partials.end());
+    }
+  }
+
+  int next_index = 0;
+  int num_components = 0;
+  vector<int> stack;
+  for (int i = 0; i < templates.size(); ++i) {
+    if (templates[i].index == -1) {
+      FindComponents(&templates, i, &next_index, &stack, &num_components);
+    }
+  }
+
+  CompileDirectoryReport local_report;
+  if (report == nullptr) report = &local_report;
+  *report = CompileDirectoryReport();
+  vector<vector<int> > members(num_components);
+  vector<vector<int> > dependents(num_components);
+  vector<int> pending(num_components, 0);
+  for (int i = 0; i < templates.size(); ++i) {
+    const DirectoryTemplate& tmpl = templates[i];
+    members[tmpl.component].push_back(i);
+    if (!tmpl.found) continue;
+    report->templates.push_back(tmpl.name);
+    for (int partial: tmpl.partials) {
+      const DirectoryTemplate& p = templates[partial];
+      if (!p.found) {
+        report->missing_partials.push_back(make_pair(tmpl.name, p.name));
+      } else if (p.component == tmpl.component) {
+        if (partial == i) report->cycles.push_back(vector<string>(1, tmpl.name));
+      } else {
+        dependents[p.component].push_back(tmpl.component);
+        ++pending[tmpl.component];
+      }
+    }
+  }
+  for (const vector<int>& component: members) {
+    if (component.size() < 2) continue;
+    report->cycles.push_back(vector<string>());
+    for (int i: component) report->cycles.back().push_back(templates[i].name);
+    sort(report->cycles.back().begin(), report->cycles.back().end());
+  }
+
+  // Components are numbered after every component they depend on, so whether each one
+  // needs recompiling can be worked out in order.
+  vector<bool> dirty(num_components, previous == nullptr);
+  for (int c = 0; c < num_components && previous != nullptr; ++c) {
+    for (int i: members[c]) {
+      const DirectoryTemplate& tmpl = templates[i];
+      if (!tmpl.found) continue;
+      if (changed.count(tmpl.name) != 0 || previous->Get(tmpl.name) == nullptr) {
+        dirty[c] = true;
+      }
+      for (int partial: tmpl.partials) {
+        const DirectoryTemplate& p = templates[partial];
+        if (changed.count(p.name) != 0 || dirty[p.component] ||
+            (!p.found && previous->Get(p.name) != nullptr)) {
+          dirty[c] = true;
+        }
+      }
+    }
+  }
+
+  // Compile each component once every component it depends on has been compiled, so
+  // that partials are in the registry, ready to be inlined, before they are used.
+  mutex lock;
+  condition_variable ready_cv;
+  vector<int> ready;
+  for (int c = 0; c < num_components; ++c) {
+    if (pending[c] == 0) ready.push_back(c);
+  }
+  int remaining = num_components;
+  ParallelFor(threads, threads, [&](int) {
+    unique_lock<mutex> l(lock);
+    while (true) {
+      while (ready.empty() && remaining > 0) ready_cv.wait(l);
+      if (remaining == 0) return;
+      int component = ready.back();
+      ready.pop_back();
+      l.unlock();
+      vector<string> malformed;
+      for (int i: members[component]) {
+        const DirectoryTemplate& tmpl = templates[i];
+        if (!tmpl.found) continue;
+        if (!dirty[component]) {
+          shared_ptr<CompiledTemplate> copy =
+              make_shared<CompiledTemplate>(*previous->Get(tmpl.name));
+          copy->registry = registry;
+          registry->Add(tmpl.name, copy);
+        } else if (registry->Compile(tmpl.name, tmpl.contents) == nullptr) {
+          malformed.push_back(tmpl.name);
+        }
+      }
+      l.lock();
+      report->malformed.insert(report->malformed.end(), malformed.begin(),
+          malformed.end());
+      for (int dependent: dependents[component]) {
+        if (--pending[dependent] == 0) ready.push_back(dependent);
+      }
+      --remaining;
+      ready_cv.notify_all();
+    }
+  });
+  sort(report->malformed.begin(), report->malformed.end());
+  sort(report->templates.begin(), report->templates.end());
+  return report->malformed.empty() && report->missing_partials.empty();
+}
+
+bool CompileDirectory(const string& root, int threads, CompileDirectoryReport* report) {
+  return CompileTree(root, threads, FileTemplateRegistry(root), nullptr, set<string>(),
+      report);
+}
+
+// Epoch-based reclamation of the snapshots of ReloadingTemplateRegistry. Every thread that
+// renders has a slot holding the epoch it started rendering in, or 0 if it isn't
+// rendering. A snapshot that was replaced in epoch e can be freed once no slot holds an
+// epoch <= e: any render that started later loaded the current snapshot pointer after
+// it was swapped. Slots are claimed and released without locks, and reused by later
+// threads.
+struct ReaderSlot {
+  atomic<uint64_t> epoch{0};
+  atomic<bool> in_use{true};
+  ReaderSlot* next = nullptr;
+
+  // Only accessed by the owning thread.
+  int depth = 0;
+};
+
+static atomic<uint64_t> global_epoch(1);
+static atomic<ReaderSlot*> reader_slots(nullptr);
+
+// Claims a slot for the calling thread, and releases it when the thread exits.
+struct ThreadReaderSlot {
+  ReaderSlot* slot = nullptr;
+
+  ThreadReaderSlot() {
+    for (ReaderSlot* s = reader_slots.load(); s != nullptr; s = s->next) {
+      bool in_use = false;
+      if (s->in_use.compare_exchange_strong(in_use, true)) {
+        slot = s;
+        return;
+      }
+    }
+    slot = new ReaderSlot();
+    slot->next = reader_slots.load();
+    while (!reader_slots.compare_exchange_weak(slot->next, slot)) { }
+  }
+
+  ~ThreadReaderSlot() { slot->in_use.store(false); }
+};
+
+static thread_local ThreadReaderSlot thread_reader_slot;
+
+// Marks the calling thread as rendering for its lifetime.
+class EpochGuard {
+ public:
+  EpochGuard() : slot_(thread_reader_slot.slot) {
+    if (slot_->depth++ == 0) slot_->epoch.store(global_epoch.load());
+  }
+
+  ~EpochGuard() {
+    if (--slot_->depth == 0) slot_->epoch.store(0);
+  }
+
+ private:
+  ReaderSlot* slot_;
+};
+
+struct ReloadingTemplateRegistry::Snapshot {
+  explicit Snapshot(const string& root)
+    : registry(make_shared<FileTemplateSource>(root)) {
+    registry.SetMetricsName(root);
+  }
+  TemplateRegistry registry;
+};
+
+ReloadingTemplateRegistry::ReloadingTemplateRegistry(const string& root, int threads)
+  : root_(root),
+    threads_(threads),
+    current_(nullptr),
+    generation_(0) {
+  Publish(nullptr);
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ == -1 || pipe(stop_fds_) != 0) {
+    cerr << "Could not watch " << root_ << " for changes" << endl;
+    return;
+  }
+  AddWatches("");
+  WatchOutsideRoot();
+  watcher_ = thread(&ReloadingTemplateRegistry::WatchLoop, this);
+}
+
+ReloadingTemplateRegistry::~ReloadingTemplateRegistry() {
+  if (watcher_.joinable()) {
+    char stop = 0;
+    if (write(stop_fds_[1], &stop, 1) != 1) cerr << "Could not stop watcher" << endl;
+    watcher_.join();
+  }
+  for (int fd: { inotify_fd_, stop_fds_[0], stop_fds_[1] }) {
+    if (fd != -1) close(fd);
+  }
+  for (const auto& retired: retired_) delete retired.first;
+  delete current_.load();
+}
+
+bool ReloadingTemplateRegistry::Render(const string& name, const Value& context,
+    stringstream* out) {
+  EpochGuard guard;
+  return current_.load()->registry.Render(name, context, out);
+}
+
+void ReloadingTemplateRegistry::Reload() {
+  Publish(nullptr);
+}
+
+// True if the template called 'name', relative to a root, is outside it, e.g. '../a'.
+bool OutsideRoot(const string& name) {
+  vector<string> components;
+  split(components, name, is_any_of("/"));
+  int depth = 0;
+  for (const string& component: components) {
+    if (component == "..") {
+      if (--depth < 0) return true;
+    } else if (!component.empty() && component != ".") {
+      ++depth;
+    }
+  }
+  return false;
+}
+
+void ReloadingTemplateRegistry::Publish(const set<string>* changed) {
+  lock_guard<mutex> l(publish_lock_);
+  Snapshot* previous = current_.load();
+  Snapshot* snapshot = new Snapshot(root_);
+  CompileDirectoryReport report;
+  if (!CompileTree(root_, threads_, &snapshot->registry,
+          changed == nullptr ? nullptr : &previous->registry,
+          changed == nullptr ? set<string>() : *changed, &report)) {
+    for (const string& name: report.malformed) {
+      cerr << "Malformed template: " << root_ << name << endl;
+    }
+  }
+  outside_dirs_.clear();
+  vector<string> names = report.templates;
+  for (const auto& missing: report.missing_partials) names.push_back(missing.second);
+  for (const string& name: names) {
+    if (OutsideRoot(name)) outside_dirs_.insert(name.substr(0, name.rfind('/') + 1));
+  }
+  snapshot->registry.Freeze();
+  current_.store(snapshot);
+  ++generation_;
+  if (previous != nullptr) retired_.push_back(make_pair(previous, global_epoch++));
+  FreeRetiredSnapshots();
+}
+
+void ReloadingTemplateRegistry::FreeRetiredSnapshots() {
+  uint64_t oldest = UINT64_MAX;
+  for (ReaderSlot* s = reader_slots.load(); s != nullptr; s = s->next) {
+    uint64_t epoch = s->epoch.load();
+    if (epoch != 0) oldest = min(oldest, epoch);
+  }
+  auto freeable = [oldest](const pair<Snapshot*, uint64_t>& retired) {
+    return retired.second < oldest;
+  };
+  for (const auto& retired: retired_) {
+    if (freeable(retired)) delete retired.first;
+  }
+  retired_.erase(remove_if(retired_.begin(), retired_.end(), freeable), retired_.end());
+}
+
+void ReloadingTemplateRegistry::AddWatches(const string& dir) {
+  static const uint32_t kEvents =
+      IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+  int wd = inotify_add_watch(inotify_fd_, (root_ + dir).c_str(), kEvents);
+  if (wd == -1) return;
+  watches_[wd] = dir;
+  DIR* d = opendir((root_ + dir).c_str());
+  if (d == nullptr) return;
+  while (struct dirent* entry = readdir(d)) {
+    string path = dir + entry->d_name;
+    struct stat st;
+    if (entry->d_name[0] == '.' || stat((root_ + path).c_str(), &st) != 0) continue;
+    if (S_ISDIR(st.st_mode)) AddWatches(path + "/");
+  }
+  closedir(d);
+}
+
+void ReloadingTemplateRegistry::WatchOutsideRoot() {
+  static const uint32_t kEvents =
+      IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+  set<string> dirs;
+  {
+    lock_guard<mutex> l(publish_lock_);
+    dirs = outside_dirs_;
+  }
+  for (const string& dir: dirs) {
+    if (outside_watches_.count(dir) != 0) continue;
+    int wd = inotify_add_watch(inotify_fd_, (root_ + dir).c_str(), kEvents);
+    if (wd == -1) continue;
+    outside_watches_.insert(dir);
+    // A directory that is also reachable from inside the root keeps its name from there.
+    watches_.insert(make_pair(wd, dir));
+  }
+}
+
+void ReloadingTemplateRegistry::WatchLoop() {
+  // Changes usually come in bursts, e.g. when a deployment replaces many files, so wait
+  // for the directory to be quiet for a short while before recompiling.
+  static const int kQuietMs = 50;
+  // While snapshots are waiting to be freed, check again this often.
+  static const int kRetryMs = 100;
+  set<string> changed;
+  // Set when the kernel's event queue overflowed, so that changes were missed.
+  bool overflowed = false;
+  while (true) {
+    // Partials outside the root are only known once a snapshot has been compiled.
+    WatchOutsideRoot();
+    pollfd fds[2] = { { inotify_fd_, POLLIN, 0 }, { stop_fds_[0], POLLIN, 0 } };
+    int timeout = -1;
+    if (!changed.empty() || overflowed) {
+      timeout = kQuietMs;
+    } else {
+      lock_guard<mutex> l(publish_lock_);
+      if (!retired_.empty()) timeout = kRetryMs;
+    }
+    int ready = poll(fds, 2, timeout);
+    if (ready < 0 && errno != EINTR) return;
+    if (fds[1].revents != 0) return;
+    if (ready == 0) {
+      if (overflowed) {
+        // Directories may have been created unseen, and any file may have changed.
+        AddWatches("");
+        Publish(nullptr);
+        changed.clear();
+        overflowed = false;
+      } else if (!changed.empty()) {
+        Publish(&changed);
+        changed.clear();
+      } else {
+        lock_guard<mutex> l(publish_lock_);
+        FreeRetiredSnapshots();
+      }
+      continue;
+    }
+    if (fds[0].revents == 0) continue;
+
+    char buffer[4096] __attribute__((aligned(__alignof__(inotify_event))));
+    ssize_t length;
+    while ((length = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+      for (char* p = buffer; p < buffer + length; ) {
+        const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+        p += sizeof(inotify_event) + event->len;
+        if ((event->mask & IN_Q_OVERFLOW) != 0) {
+          overflowed = true;
+          continue;
+        }
+        auto dir = watches_.find(event->wd);
+        if ((event->mask & IN_IGNORED) != 0 && dir != watches_.end()) {
+          outside_watches_.erase(dir->second);
+          watches_.erase(dir);
+          continue;
+        }
+        if (dir == watches_.end() || event->len == 0) continue;
+        string path = dir->second + event->name;
+        if ((event->mask & IN_ISDIR) != 0) {
+          if ((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0 && !OutsideRoot(path)) {
+            AddWatches(path + "/");
+          }
+          // Everything in a new or removed directory is new or gone, and is picked up
+          // by scanning the tree again.
+          changed.insert(path);
+          continue;
+        }
+        // A partial may be named with or without the extension.
+        changed.insert(path);
+        if (ends_with(path, ".mustache")) {
+          changed.insert(path.substr(0, path.size() - strlen(".mustache")));
+        }
+      }
+    }
+  }
 }
 
 }
@@ -10,18 +10,721 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#ifndef MUSTACHE_H
+#define MUSTACHE_H
+
 #include "rapidjson/document.h"
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 // Routines for rendering Mustache (http://mustache.github.io) templates with RapidJson
 // (https://code.google.com/p/rapidjson/) documents.
 namespace mustache {
 
+enum TagOperator {
+  SUBSTITUTION,
+  SECTION_START,
+  NEGATED_SECTION_START,
+  PREDICATE_SECTION_START,
+  SECTION_END,
+  PARTIAL,
+  COMMENT,
+  LENGTH,
+  EQUALITY,
+  INEQUALITY,
+  LITERAL,
+  TEXT, // Literal text between tags. Only appears in compiled templates.
+  NONE
+};
+
+// A single instruction in a compiled template. Ops are plain fixed-size records that
+// refer to strings by their offset in the template's pool, so that compiled templates can
+// be written to disk and memory-mapped back (see LoadTemplateBundle()).
+struct TemplateOp {
+  uint8_t op; // A TagOperator
+
+  // True if the tag was written with triple braces, i.e. {{{tag}}}.
+  uint8_t escaped;
+
+  // True if 'text' is an offset into CompiledTemplate::source rather than the pool.
+  uint8_t in_source;
+
+  uint8_t unused;
+
+  // Pool offset and length of the literal text for TEXT ops, and of the tag name for all
+  // others.
+  uint32_t text;
+  uint32_t text_length;
+
+  // Pool offset of the argument of an EQUALITY or INEQUALITY tag.
+  uint32_t arg;
+
+  // For ops that open a section, the index of the matching SECTION_END. For
+  // SECTION_END, the index of the op that opened the section. -1 otherwise.
+  int32_t end;
+
+  // Set by the optimizer: the path slot that the tag is resolved through, or -1 if the
+  // tag is resolved by walking the whole context stack. For ops that open a section,
+  // slots in [slots_begin, slots_end) belong to the contents of the section.
+  int32_t slot;
+  int32_t slots_begin;
+  int32_t slots_end;
+};
+
+// A json path that is resolved at most once each time its scope (the top level of the
+// template, or one value of a section) is entered. Within a section, only the frame
+// pushed by the section is searched; if the path isn't found there, the result is taken
+// from 'parent', the slot for the same path in the enclosing scope. This hoists lookups
+// of outer values out of loops, and shares the lookup between all tags with the same
+// path in a scope.
+struct PathSlot {
+  // Index into CompiledTemplate::components of the first of 'num_components' path
+  // components.
+  uint32_t components;
+  uint32_t num_components;
+  int32_t parent;
+};
+
+// The source offset (see CompiledTemplate::offsets) of ops that have none.
+static const uint32_t kNoOffset = 0xffffffff;
+
+// A read-only view of an array that is owned elsewhere.
+template <typename T>
+class ArrayView {
+ public:
+  ArrayView() : data_(nullptr), size_(0) { }
+  ArrayView(const T* data, size_t size) : data_(data), size_(size) { }
+
+  const T* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+  const T& operator[](size_t i) const { return data_[i]; }
+
+ private:
+  const T* data_;
+  size_t size_;
+};
+
+class TemplateRegistry;
+struct TemplateTier;
+
+// Template text that is owned elsewhere, e.g. a memory-mapped file, and stays valid and
+// unchanged for as long as 'storage' is held.
+struct TemplateText {
+  ArrayView<char> text;
+  std::shared_ptr<const void> storage;
+};
+
+// A template that has been scanned once into a flat list of ops, so that it can be
+// rendered many times without re-parsing the document. Sections are laid out inline and
+// linked to their SECTION_END by index.
+//
+// The ops, slots, path components and string pool are stored together in one immutable
+// block of memory, 'packed', which is shared between copies of the template. It is
+// either allocated by the compiler or mapped from a template bundle.
+struct CompiledTemplate {
+  ArrayView<TemplateOp> ops;
+  ArrayView<PathSlot> slots;
+
+  // Pool offsets of the components of the paths of 'slots'.
+  ArrayView<uint32_t> components;
+
+  // The offset in the template's source text of the tag each of 'ops' was compiled from,
+  // or kNoOffset. Only used to report where tags are, so kept out of the ops.
+  ArrayView<uint32_t> offsets;
+
+  // The 'op' of each of 'ops', stored on its own so that dispatching ops touches as little
+  // memory as possible.
+  ArrayView<uint8_t> opcodes;
+
+  // NUL-terminated strings referred to by the above.
+  ArrayView<char> pool;
+
+  ArrayView<char> packed;
+  std::shared_ptr<const void> storage;
+
+  // Render counts and, once the template is hot, its closure-compiled form (see
+  // SetClosureTierThreshold()). Shared by copies of the template.
+  std::shared_ptr<TemplateTier> tier;
+
+  // Set if the template was compiled from a TemplateText: literal text is then not
+  // copied into the pool, and TEXT ops with 'in_source' set refer to it instead.
+  ArrayView<char> source;
+  std::shared_ptr<const void> source_storage;
+
+  // Returns the pool string at 'offset'.
+  const char* str(uint32_t offset) const { return pool.data() + offset; }
+
+  // Returns the text of 'op', which is not NUL-terminated if it is in the source.
+  const char* text(const TemplateOp& op) const {
+    return op.in_source ? source.data() + op.text : str(op.text);
+  }
+
+  // The registry that partials are loaded from. Must outlive the template.
+  TemplateRegistry* registry = nullptr;
+
+  // Set by Specialize(): frames that are pushed on top of the render context, holding
+  // the static values the template was specialized against.
+  std::vector<std::shared_ptr<const rapidjson::Document> > static_frames;
+};
+
+// Returns the bytes of memory used by 'tmpl': the template itself, its packed ops, slots
+// and pool, and its render counters. Doesn't count source text that the template refers
+// to in place, or the closures of hot templates.
+size_t TemplateMemoryUsage(const CompiledTemplate& tmpl);
+
+// Returns a hash of the ops and text of 'tmpl', which changes if the template, or any
+// partial inlined into it, does.
+uint64_t TemplateFingerprint(const CompiledTemplate& tmpl);
+
 // Render a template contained in 'document' with respect to the json context
-// 'context'. Alternately finds a tag and then evaluates it. Returns when an error is
-// signalled (TODO: probably doesn't work in all paths), and evaluates that tag. Output is
-// accumulated in 'out'.
+// 'context'. Equivalent to CompileTemplate() followed by rendering the result, so returns
+// false without producing output if the template is malformed. Output is accumulated in
+// 'out'.
 bool RenderTemplate(const std::string& document, const std::string& document_root,
     const rapidjson::Value& context, std::stringstream* out);
 
+// Counters for the cache used by the string-based RenderTemplate().
+struct RenderCacheStats {
+  int64_t hits = 0;
+  int64_t misses = 0;
+  int64_t evictions = 0;
+
+  // Memory used by the cached templates, including their text.
+  size_t bytes = 0;
+};
+
+// Enables a process-wide cache of the templates compiled by the string-based
+// RenderTemplate(), keyed by the template text and document root, so that rendering the
+// same text again skips compilation. Least recently used templates are evicted to keep
+// the cache within 'max_bytes'. The cache is off by default; 0 turns it off and empties
+// it.
+void SetRenderCacheBudget(size_t max_bytes);
+
+RenderCacheStats GetRenderCacheStats();
+
+// Turns on or off process-wide metrics of the renders made by TemplateRegistry::Render(),
+// by registry (see TemplateRegistry::SetMetricsName()) and template name: renders,
+// errors, output bytes and latency, and lookups of the template in its registry, to be
+// rendered or as a partial, with how many had to load it from the source. Counters are
+// split into 16 shards, one per thread until there are more threads than that, so
+// threads rendering the same template rarely contend on them. Off by default.
+//
+// Every registry and template name is a series that is kept until the process exits, so
+// their number is capped at 'max_series'. Past that, renders and lookups of templates
+// without a series are counted under the template name "", as are those of templates
+// that don't exist.
+void SetRenderMetrics(bool enabled, size_t max_series = 1000);
+
+// The metrics of one template (see SetRenderMetrics()).
+struct RenderMetrics {
+  // Renders, renders that failed or whose template couldn't be loaded, and the bytes
+  // they wrote.
+  int64_t renders = 0;
+  int64_t errors = 0;
+  int64_t bytes = 0;
+
+  // The total time of the renders, and the latency of the median, 99th and 99.9th
+  // percentile renders. Latencies are counted in histogram buckets, and are accurate to
+  // within 1/16th.
+  int64_t nanoseconds = 0;
+  int64_t p50_nanoseconds = 0;
+  int64_t p99_nanoseconds = 0;
+  int64_t p999_nanoseconds = 0;
+
+  // Lookups of the template to be rendered and as a partial, and the lookups of each
+  // kind that had to load it from the registry's source.
+  int64_t template_lookups = 0;
+  int64_t template_misses = 0;
+  int64_t partial_lookups = 0;
+  int64_t partial_misses = 0;
+};
+
+// Returns the metrics of the template called 'name' in the registries whose metrics name
+// is 'registry'.
+RenderMetrics GetRenderMetrics(const std::string& name,
+    const std::string& registry = "");
+
+// Returns all metrics, including those of the render cache, in the Prometheus text
+// exposition format.
+std::string ExportRenderMetrics();
+
+// Writes ExportRenderMetrics() to the file at 'path', replacing it atomically so that a
+// scraper reading the file never sees it half written. Returns false on error.
+bool WriteRenderMetrics(const std::string& path);
+
+// Captures renders by TemplateRegistry::Render() that take at least
+// 'threshold_nanoseconds', so that slow renders can be reproduced. Each capture is a json
+// file in 'directory' holding the template's name and TemplateFingerprint(), the context
+// it was rendered with, and the RenderStats of a profiled re-render. Only the last
+// 'max_captures' are kept, in files capture-<n>.json that are overwritten in turn. Rerun
+// a capture with mustache-replay. A threshold of 0 stops capturing, and ignores the other
+// arguments. Otherwise returns false, and doesn't capture, if 'directory' is empty.
+//
+// A capture is made by the thread that rendered, after the render, and takes about as
+// long again plus the time to write the file. So that a burst of slow renders doesn't
+// slow down all of them, at most 'max_per_second' renders are captured a second (0 for
+// no limit), and slow renders that finish while another is being captured are skipped.
+bool SetSlowRenderCapture(int64_t threshold_nanoseconds, const std::string& directory,
+    int max_captures = 64, int max_per_second = 1);
+
+struct CompileOptions {
+  // If true, tag lookups are assigned path slots (see PathSlot). Turning this off gives
+  // the plain evaluation order, which is useful for differential testing.
+  bool optimize = true;
+
+  // Partials with at most this many ops are spliced into the template at compile time,
+  // rather than being looked up and rendered on every evaluation. Recursive partials are
+  // never inlined, and nor are partials from registries that check for updates. 0
+  // disables inlining.
+  int max_inline_ops = 256;
+
+  // The registry to load partials from. If not set, partials are read from files
+  // relative to the document root, through FileTemplateRegistry().
+  TemplateRegistry* registry = nullptr;
+
+  // If 'registry' isn't set: whether partials read from files are checked for updates,
+  // with a stat() call on every lookup, so that partials that are created or edited while
+  // the process runs are picked up. Partials are then never inlined. Otherwise templates
+  // that have been loaded, or found to be missing, are looked up without any I/O.
+  bool check_for_updates = false;
+
+  // If true, templates compiled by a registry that come out identical to one compiled
+  // earlier, by any registry and under any name, share its memory (see
+  // GetInternedTemplateStats()). Memory then grows with the number of distinct
+  // templates rather than the number of registries that load them.
+  bool deduplicate = true;
+};
+
+// Counters for the templates shared through CompileOptions::deduplicate.
+struct InternedTemplateStats {
+  // Distinct templates in use, and the memory used by their packed forms.
+  int64_t unique = 0;
+  size_t bytes = 0;
+
+  // The number of compiled templates that were found to be the same as one in use.
+  int64_t hits = 0;
+};
+
+InternedTemplateStats GetInternedTemplateStats();
+
+// Compiles 'document' into 'tmpl'. Partials are resolved relative to 'document_root'
+// when the template is rendered. Returns false if the template is malformed, e.g. if
+// sections are not properly nested.
+bool CompileTemplate(const std::string& document, const std::string& document_root,
+    CompiledTemplate* tmpl, const CompileOptions& options = CompileOptions());
+
+// Like the above, but if 'document.storage' is set, the compiled template holds on to
+// it and refers to literal text in 'document' rather than copying it.
+bool CompileTemplate(const TemplateText& document, const std::string& document_root,
+    CompiledTemplate* tmpl, const CompileOptions& options = CompileOptions());
+
+// Renders a template previously compiled with CompileTemplate() with respect to the json
+// context 'context'. Output is accumulated in 'out'.
+bool RenderTemplate(const CompiledTemplate& tmpl, const rapidjson::Value& context,
+    std::stringstream* out);
+
+// What a profiled render spent on one tag of a template (see RenderStats).
+struct TagStats {
+  // The template the tag is in: the name it was rendered or included as, or empty for
+  // the template passed to RenderTemplate(). Tags of partials that were inlined at
+  // compile time belong to the template they were inlined into.
+  std::string template_name;
+
+  // The byte offset of the tag in the template's source text, and the tag as written,
+  // e.g. "{{#variants}}". Tags of inlined partials are at the partial's tag, and the
+  // offset is -1 for tags with no place in the source, such as the end of a section
+  // that was left open.
+  int offset = -1;
+  std::string tag;
+
+  // The number of times the tag was evaluated. A section counts once however many values
+  // it is rendered for.
+  int64_t count = 0;
+
+  // Time spent on the tag, and bytes it wrote. For sections and partials these include
+  // everything rendered inside them, so a recursive partial counts its nested calls
+  // again.
+  int64_t nanoseconds = 0;
+  int64_t bytes = 0;
+
+  // Lookups of the tag's value that weren't answered by a path slot, and the context
+  // frames those lookups searched.
+  int64_t lookups = 0;
+  int64_t frames_walked = 0;
+};
+
+// What a profiled render spent at one point of the template call structure.
+struct StackStats {
+  // The constructs being rendered, outermost first and separated by ';', e.g.
+  // "page;{{#items}};row;{{price}}". The first is the name of the template rendered, or
+  // "template" if it has none, and partials appear as the name of the partial.
+  std::string stack;
+
+  // Time spent and bytes written by the innermost construct itself, not counting the
+  // constructs within it. For templates and sections, this is mostly literal text.
+  int64_t nanoseconds = 0;
+  int64_t bytes = 0;
+};
+
+struct RenderStats {
+  // The whole render.
+  int64_t nanoseconds = 0;
+  int64_t bytes = 0;
+
+  // Every tag that was evaluated, slowest first. Literal text isn't listed; its cost is
+  // part of the sections and partials it appears in.
+  std::vector<TagStats> tags;
+
+  // Every distinct stack of constructs that was rendered, for flame graphs (see
+  // WriteFoldedStacks()).
+  std::vector<StackStats> stacks;
+};
+
+enum StackWeight {
+  kWeighByTime,
+  kWeighByBytes
+};
+
+// Writes 'stacks' in the folded format read by flamegraph.pl and speedscope: one line per
+// stack, followed by its time in nanoseconds or its bytes. Stacks that are listed more
+// than once, e.g. when the stacks of many renders are collected together, are added up.
+void WriteFoldedStacks(const std::vector<StackStats>& stacks, StackWeight weight,
+    std::ostream* out);
+
+// Like the above, but also profiles the render into 'stats', so that a slow render can
+// be attributed to the sections and partials it spent its time in. Profiled renders
+// always run in the interpreter and don't count towards the closure tier (see
+// SetClosureTierThreshold()); renders that aren't profiled pay nothing for this.
+bool RenderTemplate(const CompiledTemplate& tmpl, const rapidjson::Value& context,
+    std::stringstream* out, RenderStats* stats);
+
+// How the ops of compiled templates are dispatched while rendering.
+enum DispatchMode {
+  // A loop around a switch on each op. Works with any compiler.
+  kSwitchDispatch,
+
+  // Direct threading: the handler of each op jumps straight to the handler of the next
+  // through computed goto. Only available with GCC and Clang; elsewhere this falls back
+  // to kSwitchDispatch.
+  kThreadedDispatch
+};
+
+// Sets the dispatch mode for all renders that start from now on. The default is
+// kThreadedDispatch, unless built with MUSTACHE_SWITCH_DISPATCH defined.
+void SetDispatchMode(DispatchMode mode);
+
+// Returns the current dispatch mode, e.g. to restore it after SetDispatchMode().
+DispatchMode GetDispatchMode();
+
+// Templates are rendered by the interpreter until they have been rendered 'renders' times,
+// after which they are lowered into a tree of closures, one per op with its operands
+// bound in, which renders faster but takes time and memory to build. This keeps rarely
+// used templates cheap while the most used get the faster tier automatically. The
+// default is 1000; 0 turns the closure tier off.
+void SetClosureTierThreshold(int64_t renders);
+
+// Sets the deepest that sections and partials may nest in renders that start from now on.
+// Sections and partials are tracked on the heap rather than the call stack, so deep data
+// and recursive partials can't overflow the stack; a render that goes deeper than
+// 'depth' stops and RenderTemplate() returns false, leaving whatever was rendered so far
+// in the output. The default is 10000.
+void SetMaxRenderDepth(int depth);
+
+// Partially evaluates 'tmpl' against 'static_context', and writes the result to
+// 'specialized'. Rendering 'specialized' with some context gives the same output as
+// rendering 'tmpl' with 'static_context' pushed as the innermost frame on top of that
+// context. Every tag that resolves against the static context is folded into literal
+// text, sections whose condition is statically known are either inlined or removed, and
+// only the remainder is evaluated at render time. 'static_context' is copied, so need not
+// outlive 'specialized'.
+bool Specialize(const CompiledTemplate& tmpl, const rapidjson::Value& static_context,
+    CompiledTemplate* specialized);
+
+// Where a TemplateRegistry reads the text of templates from.
+class TemplateSource {
+ public:
+  virtual ~TemplateSource() {}
+
+  // Reads the template called 'name' into 'contents'. Returns false if there is no such
+  // template.
+  virtual bool Read(const std::string& name, std::string* contents) = 0;
+
+  // Returns a value that changes whenever the template called 'name' changes, and is 0 if
+  // there is no such template. Sources that can't tell always return 0.
+  virtual int64_t GetVersion(const std::string& name) { return 0; }
+
+  // Like Read(), but returns the template as text that the compiled template can refer to
+  // rather than copy. Returns false if the source doesn't support this for 'name', in
+  // which case Read() is used instead.
+  virtual bool Map(const std::string& name, TemplateText* text) { return false; }
+};
+
+// Reads templates from files under a root directory. A template called 'name' is read
+// from <root><name> or, if that doesn't exist, <root><name>.mustache.
+class FileTemplateSource : public TemplateSource {
+ public:
+  // Files of at least 'mmap_threshold' bytes are memory-mapped, and the templates compiled
+  // from them refer to literal text in the mapping rather than copying it, so their text
+  // is held once, in the page cache, and shared between processes. Mapped files must be
+  // replaced (e.g. by renaming a new file over them) rather than rewritten in place while
+  // templates compiled from them are in use. 0 disables mapping.
+  explicit FileTemplateSource(const std::string& root, size_t mmap_threshold = 0)
+    : root_(root), mmap_threshold_(mmap_threshold) { }
+  virtual bool Read(const std::string& name, std::string* contents);
+  virtual bool Map(const std::string& name, TemplateText* text);
+
+  // Based on the modification time and size of the file, as returned by stat().
+  virtual int64_t GetVersion(const std::string& name);
+
+ private:
+  const std::string root_;
+  const size_t mmap_threshold_;
+};
+
+// Serves templates from memory, e.g. for tests or templates that are generated at
+// runtime.
+class MemoryTemplateSource : public TemplateSource {
+ public:
+  // Adds or replaces the template called 'name'.
+  void Add(const std::string& name, const std::string& contents);
+  virtual bool Read(const std::string& name, std::string* contents);
+  virtual int64_t GetVersion(const std::string& name);
+
+ private:
+  std::mutex lock_;
+  int64_t next_version_ = 1;
+  std::map<std::string, std::pair<std::string, int64_t> > templates_;
+};
+
+// A template whose text is compiled into the binary, as generated by mustache-embed (see
+// the mustache_embed_templates() CMake function and the mustache_templates() Bazel
+// macro).
+struct EmbeddedTemplate {
+  const char* name;
+  const char* contents;
+  size_t length;
+};
+
+// Serves templates embedded in the binary, so loading them needs no file I/O. Like
+// FileTemplateSource, a template called 'name' is also found as 'name.mustache'.
+class EmbeddedTemplateSource : public TemplateSource {
+ public:
+  // 'templates' points to an array of 'count' templates, which must outlive the source.
+  EmbeddedTemplateSource(const EmbeddedTemplate* templates, int count);
+  virtual bool Read(const std::string& name, std::string* contents);
+
+ private:
+  std::map<std::string, const EmbeddedTemplate*> templates_;
+};
+
+// Compiles templates from a TemplateSource on first use, and caches them by name so that
+// later lookups, such as a partial rendered once per element of a long list, need no I/O
+// or compilation. Partials of templates compiled by a registry are loaded from the same
+// registry. Thread-safe.
+class TemplateRegistry {
+ public:
+  // If 'check_for_updates' is true, every lookup asks the source whether the template
+  // has changed since it was compiled (for files, with a stat() call) and recompiles it if
+  // so. Otherwise templates are never reloaded.
+  TemplateRegistry(std::shared_ptr<TemplateSource> source, bool check_for_updates = false,
+      const CompileOptions& options = CompileOptions());
+
+  // Returns the compiled template called 'name', or nullptr if the template doesn't exist
+  // or is malformed. Both outcomes are cached.
+  std::shared_ptr<const CompiledTemplate> Get(const std::string& name);
+
+  // Renders the template called 'name'. Returns false if it couldn't be loaded.
+  bool Render(const std::string& name, const rapidjson::Value& context,
+      std::stringstream* out);
+
+  // As above, profiling the render into 'stats' (see RenderTemplate()).
+  bool Render(const std::string& name, const rapidjson::Value& context,
+      std::stringstream* out, RenderStats* stats);
+
+  // Compiles 'contents' as the template called 'name', and caches the result as if it
+  // had been read from the source. Returns nullptr if the template is malformed, or if
+  // the registry is frozen.
+  std::shared_ptr<const CompiledTemplate> Compile(const std::string& name,
+      const std::string& contents);
+
+  // Adds 'tmpl', which must load its partials from this registry, under 'name',
+  // replacing any template of that name. Returns false if the registry is frozen.
+  bool Add(const std::string& name, std::shared_ptr<const CompiledTemplate> tmpl);
+
+  // Drops all cached templates. Returns false if the registry is frozen.
+  bool Clear();
+
+  // Stops the registry from changing: from now on, Get() only returns templates that are
+  // already in the registry, and does so without taking a lock, and Compile(), Add() and
+  // Clear() fail. This hands a fully built registry over to readers, so must be called
+  // before the registry is shared between threads.
+  void Freeze();
+
+  // Sets the name that the render metrics of this registry's templates are labelled
+  // with (see SetRenderMetrics()); registries with the same name share metrics. Must be
+  // called before the registry is shared between threads. Registries are named "" by
+  // default, except for those of FileTemplateRegistry() and ReloadingTemplateRegistry,
+  // which are named after their root.
+  void SetMetricsName(const std::string& name);
+  const std::string& metrics_name() const { return metrics_name_; }
+
+  bool check_for_updates() const { return check_for_updates_; }
+
+ private:
+  struct Entry {
+    std::shared_ptr<const CompiledTemplate> tmpl;
+    int64_t version;
+  };
+
+  std::shared_ptr<const CompiledTemplate> Compile(const std::string& name,
+      const TemplateText& text, int64_t version);
+
+  const std::shared_ptr<TemplateSource> source_;
+  const bool check_for_updates_;
+  CompileOptions options_;
+  std::atomic<bool> frozen_{false};
+  std::string metrics_name_;
+
+  std::mutex lock_;
+  std::map<std::string, Entry> templates_;
+};
+
+struct BundleOptions {
+  // If true, every offset in the bundle is checked before it is used. Only turn this off
+  // for bundles from a trusted source.
+  bool verify = true;
+
+  // If true, advises the kernel to back the mapping with huge pages, to reduce TLB misses
+  // when rendering from large bundles. Has no effect where this isn't supported.
+  bool huge_pages = false;
+};
+
+// Writes 'templates' to a template bundle at 'path': a single file holding the ops, slots
+// and string pools of every template, in the same layout as they have in memory.
+// Partials that weren't inlined are stored as references by name. Templates made by
+// Specialize() can't be bundled. Returns false on error.
+bool WriteTemplateBundle(const std::string& path,
+    const std::map<std::string, std::shared_ptr<const CompiledTemplate> >& templates);
+
+// Memory-maps the template bundle at 'path' and adds every template in it to 'registry',
+// from which they will load their partials. The templates are used in place, so loading
+// needs no parsing or copying, and processes that load the same bundle share its pages.
+// Returns false if the bundle can't be read or is malformed, or 'registry' is frozen.
+bool LoadTemplateBundle(const std::string& path, TemplateRegistry* registry,
+    const BundleOptions& options = BundleOptions());
+
+// Describes the templates compiled by CompileDirectory(), and the problems found in them.
+struct CompileDirectoryReport {
+  // Every template that was found, including partials outside the directory tree.
+  std::vector<std::string> templates;
+
+  // Templates that couldn't be compiled.
+  std::vector<std::string> malformed;
+
+  // (template, partial) pairs where the partial doesn't exist.
+  std::vector<std::pair<std::string, std::string> > missing_partials;
+
+  // Groups of templates that refer to each other through partials, each sorted by name. A
+  // template that uses itself as a partial is a group of one. Recursive partials render
+  // correctly, but are never inlined into each other.
+  std::vector<std::vector<std::string> > cycles;
+};
+
+// Compiles every .mustache file under 'root', and every partial they refer to, into
+// FileTemplateRegistry(root), so that rendering them later needs no compilation and no
+// I/O. Templates are named by their path relative to 'root' without the extension, as
+// they would be in a partial tag. Partials are compiled before the templates that use
+// them, so that they can be inlined, and templates that don't depend on each other are
+// compiled in parallel on up to 'threads' threads (0 for one per core). Returns false if
+// any template is malformed or refers to a partial that doesn't exist; if 'report' is
+// set, it is filled in either way.
+bool CompileDirectory(const std::string& root, int threads,
+    CompileDirectoryReport* report = nullptr);
+
+// Serves every template under a directory, as compiled by CompileDirectory(), and keeps
+// them up to date as the files change. A background thread watches the directory with
+// inotify, recompiles templates that changed along with the templates that use them, and
+// atomically publishes a new snapshot of all the templates. Rendering takes no locks and
+// always sees a consistent snapshot; replaced snapshots are freed once no render that
+// started before the swap is still running. Partials outside the directory (e.g.
+// {{>../shared}}) are watched too, though only the directories they are in, not the
+// trees below them. If inotify drops events, everything is recompiled.
+class ReloadingTemplateRegistry {
+ public:
+  // Compiles the templates under 'root' on up to 'threads' threads (0 for one per core)
+  // before returning.
+  explicit ReloadingTemplateRegistry(const std::string& root, int threads = 0);
+  ~ReloadingTemplateRegistry();
+
+  // Renders the template called 'name' from the current snapshot. Returns false if it
+  // doesn't exist or is malformed.
+  bool Render(const std::string& name, const rapidjson::Value& context,
+      std::stringstream* out);
+
+  // Recompiles every template now, and publishes the result.
+  void Reload();
+
+  // The number of snapshots published so far, starting with 1 for the initial one.
+  int64_t generation() const { return generation_.load(); }
+
+ private:
+  struct Snapshot;
+
+  // Compiles the templates named in 'changed', and those that use them, into a new
+  // snapshot and publishes it. Recompiles everything if 'changed' is null.
+  void Publish(const std::set<std::string>* changed);
+
+  // Frees replaced snapshots that no render can still be using.
+  void FreeRetiredSnapshots();
+
+  // Watches every directory under root_ that isn't watched yet.
+  void AddWatches(const std::string& dir);
+  // Watches the directories in outside_dirs_ that aren't watched yet.
+  void WatchOutsideRoot();
+  void WatchLoop();
+
+  const std::string root_;
+  const int threads_;
+  std::atomic<Snapshot*> current_;
+  std::atomic<int64_t> generation_;
+
+  // Serializes Publish(), and guards the members below.
+  std::mutex publish_lock_;
+
+  // Replaced snapshots, with the epoch in which they were replaced.
+  std::vector<std::pair<Snapshot*, uint64_t> > retired_;
+
+  // Directories outside root_, relative to it, that the current snapshot's templates
+  // load partials from, or would if they existed.
+  std::set<std::string> outside_dirs_;
+
+  int inotify_fd_ = -1;
+  int stop_fds_[2] = { -1, -1 };
+  std::map<int, std::string> watches_;
+  // The directories of outside_dirs_ that are in watches_. Only used by the watcher.
+  std::set<std::string> outside_watches_;
+  std::thread watcher_;
+};
+
+// Returns the process-wide registry of templates read from files under 'root', which
+// checks the files for updates if 'check_for_updates' is true (see TemplateRegistry).
+// Templates compiled without an explicit registry load their partials from here. There
+// is one per distinct 'root' and 'check_for_updates', kept for the life of the process,
+// since templates compiled against it refer to it.
+TemplateRegistry* FileTemplateRegistry(const std::string& root,
+    bool check_for_updates = false);
+
 }
+
+#endif